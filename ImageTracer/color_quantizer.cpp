@@ -0,0 +1,453 @@
+//
+//  color_quantizer.cpp
+//  ImageTracer
+//
+
+#include "color_quantizer.hpp"
+#include <algorithm>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#define IMGTRACE_X86
+#include <immintrin.h>
+#endif
+
+namespace IMGTrace
+{
+
+void ColorQuantizer::quantize(const ImageData& img, std::vector<Color>& palette, Grid<uint8_t>& array) {
+    palette = createPalette(img);
+    mapToPalette(img, palette, array);
+}
+
+// Threshold
+
+// Writes 0 for light and 1 for dark pixels of an RGB row, a pixel is light if its value is at
+// least minLight (1 ... 255). channel is 0, 1, 2 for R, G, B and 3 for luminance.
+typedef void (*BinarizeKernel)(const uint8_t* rgb, uint8_t* out, int count, int channel, int minLight);
+
+static void binarizeScalar(const uint8_t* rgb, uint8_t* out, int count, int channel, int minLight) {
+    for (int x = 0; x < count; x++, rgb += 3) {
+        int value = channel < 3 ? rgb[channel] : (77 * rgb[0] + 150 * rgb[1] + 29 * rgb[2] + 128) >> 8;
+        out[x] = value >= minLight ? 0 : 1;
+    }
+}
+
+#ifdef IMGTRACE_X86
+// Gathers the R, G and B bytes of 16 pixels from three 16 byte blocks
+#define IMGTRACE_SPLIT_MASKS \
+    const __m128i r0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1); \
+    const __m128i r1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1); \
+    const __m128i r2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13); \
+    const __m128i g0 = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1); \
+    const __m128i g1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1); \
+    const __m128i g2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14); \
+    const __m128i b0 = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1); \
+    const __m128i b1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1); \
+    const __m128i b2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+
+#if defined(__GNUC__)
+__attribute__((target("ssse3")))
+static void binarizeSSSE3(const uint8_t* rgb, uint8_t* out, int count, int channel, int minLight) {
+    IMGTRACE_SPLIT_MASKS
+    const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+    const __m128i wr = _mm_set1_epi16(77), wg = _mm_set1_epi16(150), wb = _mm_set1_epi16(29), round = _mm_set1_epi16(128);
+    const __m128i limit = _mm_set1_epi8((char)minLight);
+    int x = 0;
+    for (; x + 16 <= count; x += 16, rgb += 48) {
+        __m128i a = _mm_loadu_si128((const __m128i*)rgb);
+        __m128i b = _mm_loadu_si128((const __m128i*)(rgb + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(rgb + 32));
+        __m128i value;
+        if (channel == 0) {
+            value = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, r0), _mm_shuffle_epi8(b, r1)), _mm_shuffle_epi8(c, r2));
+        } else if (channel == 1) {
+            value = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, g0), _mm_shuffle_epi8(b, g1)), _mm_shuffle_epi8(c, g2));
+        } else if (channel == 2) {
+            value = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, b0), _mm_shuffle_epi8(b, b1)), _mm_shuffle_epi8(c, b2));
+        } else {
+            __m128i r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, r0), _mm_shuffle_epi8(b, r1)), _mm_shuffle_epi8(c, r2));
+            __m128i g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, g0), _mm_shuffle_epi8(b, g1)), _mm_shuffle_epi8(c, g2));
+            __m128i bl = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, b0), _mm_shuffle_epi8(b, b1)), _mm_shuffle_epi8(c, b2));
+            // 77 + 150 + 29 = 256, so the 16 bit sums can't overflow
+            __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(r, zero), wr), _mm_mullo_epi16(_mm_unpacklo_epi8(g, zero), wg)),
+                _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(bl, zero), wb), round));
+            __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(r, zero), wr), _mm_mullo_epi16(_mm_unpackhi_epi8(g, zero), wg)),
+                _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(bl, zero), wb), round));
+            value = _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+        }
+        // value >= minLight as unsigned bytes
+        __m128i light = _mm_cmpeq_epi8(_mm_max_epu8(value, limit), value);
+        _mm_storeu_si128((__m128i*)(out + x), _mm_andnot_si128(light, one));
+    }
+    binarizeScalar(rgb, out + x, count - x, channel, minLight);
+}
+
+__attribute__((target("avx2")))
+static void binarizeAVX2(const uint8_t* rgb, uint8_t* out, int count, int channel, int minLight) {
+    IMGTRACE_SPLIT_MASKS
+    // The low lanes hold pixels 0 - 15, the high lanes pixels 16 - 31
+    const __m256i mr0 = _mm256_broadcastsi128_si256(r0), mr1 = _mm256_broadcastsi128_si256(r1), mr2 = _mm256_broadcastsi128_si256(r2);
+    const __m256i mg0 = _mm256_broadcastsi128_si256(g0), mg1 = _mm256_broadcastsi128_si256(g1), mg2 = _mm256_broadcastsi128_si256(g2);
+    const __m256i mb0 = _mm256_broadcastsi128_si256(b0), mb1 = _mm256_broadcastsi128_si256(b1), mb2 = _mm256_broadcastsi128_si256(b2);
+    const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi8(1);
+    const __m256i wr = _mm256_set1_epi16(77), wg = _mm256_set1_epi16(150), wb = _mm256_set1_epi16(29), round = _mm256_set1_epi16(128);
+    const __m256i limit = _mm256_set1_epi8((char)minLight);
+    int x = 0;
+    for (; x + 32 <= count; x += 32, rgb += 96) {
+        __m256i a = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)rgb)), _mm_loadu_si128((const __m128i*)(rgb + 48)), 1);
+        __m256i b = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(rgb + 16))), _mm_loadu_si128((const __m128i*)(rgb + 64)), 1);
+        __m256i c = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(rgb + 32))), _mm_loadu_si128((const __m128i*)(rgb + 80)), 1);
+        __m256i value;
+        if (channel == 0) {
+            value = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(a, mr0), _mm256_shuffle_epi8(b, mr1)), _mm256_shuffle_epi8(c, mr2));
+        } else if (channel == 1) {
+            value = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(a, mg0), _mm256_shuffle_epi8(b, mg1)), _mm256_shuffle_epi8(c, mg2));
+        } else if (channel == 2) {
+            value = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(a, mb0), _mm256_shuffle_epi8(b, mb1)), _mm256_shuffle_epi8(c, mb2));
+        } else {
+            __m256i r = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(a, mr0), _mm256_shuffle_epi8(b, mr1)), _mm256_shuffle_epi8(c, mr2));
+            __m256i g = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(a, mg0), _mm256_shuffle_epi8(b, mg1)), _mm256_shuffle_epi8(c, mg2));
+            __m256i bl = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(a, mb0), _mm256_shuffle_epi8(b, mb1)), _mm256_shuffle_epi8(c, mb2));
+            // unpack and pack work per lane, so the pixel order is kept
+            __m256i lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(r, zero), wr), _mm256_mullo_epi16(_mm256_unpacklo_epi8(g, zero), wg)),
+                _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(bl, zero), wb), round));
+            __m256i hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(r, zero), wr), _mm256_mullo_epi16(_mm256_unpackhi_epi8(g, zero), wg)),
+                _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(bl, zero), wb), round));
+            value = _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8));
+        }
+        __m256i light = _mm256_cmpeq_epi8(_mm256_max_epu8(value, limit), value);
+        _mm256_storeu_si256((__m256i*)(out + x), _mm256_andnot_si256(light, one));
+    }
+    binarizeSSSE3(rgb, out + x, count - x, channel, minLight);
+}
+#endif
+#endif
+
+// Picks the widest kernel the CPU supports, once
+static BinarizeKernel binarizeKernel() {
+    static const BinarizeKernel kernel = []() -> BinarizeKernel {
+#if defined(IMGTRACE_X86) && defined(__GNUC__)
+        if (__builtin_cpu_supports("avx2")) {
+            return binarizeAVX2;
+        }
+        if (__builtin_cpu_supports("ssse3")) {
+            return binarizeSSSE3;
+        }
+#endif
+        return binarizeScalar;
+    }();
+    return kernel;
+}
+
+ThresholdQuantizer::ThresholdQuantizer(int threshold, ThresholdChannel channel) : threshold(threshold), channel(channel) {}
+
+std::vector<Color> ThresholdQuantizer::createPalette(const ImageData& img) {
+    std::vector<Color> palette(2);
+    palette[0] = {
+        .r = 255, .g = 255, .b = 255, .a = 255
+    };
+    palette[1] = {
+        .r = 0, .g = 0, .b = 0, .a = 255
+    };
+    return palette;
+}
+
+void ThresholdQuantizer::quantize(const ImageData& img, std::vector<Color>& palette, Grid<uint8_t>& array) {
+    palette = createPalette(img);
+
+    // Row by row, straight into the padded index array
+    for (int y = 0; y < img.height; y++) {
+        quantizeRow(img.pixels + (size_t)y * img.width * 3, img.width, palette, array[y + 1] + 1);
+    }
+}
+
+bool ThresholdQuantizer::fixedPalette(std::vector<Color>& palette) {
+    palette = createPalette(ImageData());
+    return true;
+}
+
+void ThresholdQuantizer::quantizeRow(const uint8_t* rgb, int width, const std::vector<Color>& palette, uint8_t* out) {
+    // 255 - value < threshold, written as value >= minLight
+    int minLight = 256 - threshold;
+    int channelIndex = channel == ThresholdChannel::Red ? 0 : (channel == ThresholdChannel::Green ? 1 : (channel == ThresholdChannel::Blue ? 2 : 3));
+
+    if (minLight <= 0 || minLight > 255) {
+        memset(out, minLight <= 0 ? 0 : 1, width);
+    } else {
+        binarizeKernel()(rgb, out, width, channelIndex, minLight);
+    }
+}
+
+// Fixed palette
+
+PaletteQuantizer::PaletteQuantizer(std::vector<Color> palette) : palette(std::move(palette)) {
+    if (this->palette.size() > 255) {
+        this->palette.resize(255);
+    }
+    if (this->palette.empty()) {
+        this->palette.push_back({ .r = 0, .g = 0, .b = 0, .a = 255 });
+    }
+}
+
+std::vector<Color> PaletteQuantizer::createPalette(const ImageData& img) {
+    return palette;
+}
+
+bool PaletteQuantizer::fixedPalette(std::vector<Color>& palette) {
+    palette = this->palette;
+    return true;
+}
+
+// Color histogram with 5 bits per channel, every used bin becomes a color weighted by its
+// pixel count. Palettes are built from these instead of the pixels, so their cost doesn't
+// depend on the image size.
+struct WeightedColor {
+    double r, g, b;
+    uint32_t count;
+};
+
+static std::vector<WeightedColor> colorHistogram(const ImageData& img) {
+    struct Bin {
+        uint32_t count;
+        uint64_t r, g, b;
+    };
+    std::vector<Bin> bins(32768, Bin{0, 0, 0, 0});
+
+    for (int y = 0; y < img.height; y++) {
+        const uint8_t* pixel = img.pixels + (size_t)y * img.width * 3;
+        for (int x = 0; x < img.width; x++, pixel += 3) {
+            Bin& bin = bins[((pixel[0] >> 3) << 10) | ((pixel[1] >> 3) << 5) | (pixel[2] >> 3)];
+            bin.count++;
+            bin.r += pixel[0];
+            bin.g += pixel[1];
+            bin.b += pixel[2];
+        }
+    }
+
+    std::vector<WeightedColor> colors;
+    for (const Bin& bin : bins) {
+        if (bin.count > 0) {
+            colors.push_back({ (double)bin.r / bin.count, (double)bin.g / bin.count, (double)bin.b / bin.count, bin.count });
+        }
+    }
+    return colors;
+}
+
+static Color toColor(double r, double g, double b) {
+    return { (int)(r + 0.5), (int)(g + 0.5), (int)(b + 0.5), 255 };
+}
+
+static double channel(const WeightedColor& color, int axis) {
+    return axis == 0 ? color.r : (axis == 1 ? color.g : color.b);
+}
+
+static std::vector<Color> medianCut(std::vector<WeightedColor>& colors, int colorCount) {
+    // Boxes are ranges of the colors array, which gets reordered while splitting
+    struct Box {
+        int begin, end;
+        uint64_t count;
+    };
+    std::vector<Box> boxes;
+    uint64_t total = 0;
+    for (const WeightedColor& color : colors) {
+        total += color.count;
+    }
+    boxes.push_back({ 0, (int)colors.size(), total });
+
+    while (boxes.size() < colorCount) {
+        // Box with the most pixels which still has more than one color
+        int boxIndex = -1;
+        for (int k = 0; k < boxes.size(); k++) {
+            if ((boxes[k].end - boxes[k].begin > 1) && (boxIndex < 0 || boxes[k].count > boxes[boxIndex].count)) {
+                boxIndex = k;
+            }
+        }
+        if (boxIndex < 0) {
+            break;
+        }
+        Box box = boxes[boxIndex];
+
+        // Longest axis
+        double minc[3] = { 255, 255, 255 }, maxc[3] = { 0, 0, 0 };
+        for (int k = box.begin; k < box.end; k++) {
+            for (int axis = 0; axis < 3; axis++) {
+                minc[axis] = std::min(minc[axis], channel(colors[k], axis));
+                maxc[axis] = std::max(maxc[axis], channel(colors[k], axis));
+            }
+        }
+        int axis = 0;
+        for (int a = 1; a < 3; a++) {
+            if (maxc[a] - minc[a] > maxc[axis] - minc[axis]) {
+                axis = a;
+            }
+        }
+
+        // Split at the median pixel, keeping at least one color on both sides
+        std::sort(colors.begin() + box.begin, colors.begin() + box.end, [axis](const WeightedColor& a, const WeightedColor& b) {
+            return channel(a, axis) < channel(b, axis);
+        });
+        uint64_t half = 0;
+        int split = box.begin + 1;
+        for (int k = box.begin; k < box.end - 1; k++) {
+            half += colors[k].count;
+            split = k + 1;
+            if (half * 2 >= box.count) {
+                break;
+            }
+        }
+
+        boxes[boxIndex] = { box.begin, split, half };
+        boxes.push_back({ split, box.end, box.count - half });
+    }
+
+    std::vector<Color> palette;
+    for (const Box& box : boxes) {
+        double r = 0, g = 0, b = 0;
+        for (int k = box.begin; k < box.end; k++) {
+            r += colors[k].r * colors[k].count;
+            g += colors[k].g * colors[k].count;
+            b += colors[k].b * colors[k].count;
+        }
+        if (box.count > 0) {
+            palette.push_back(toColor(r / box.count, g / box.count, b / box.count));
+        }
+    }
+    return palette;
+}
+
+// Median cut
+
+MedianCutQuantizer::MedianCutQuantizer(int colorCount) : colorCount(std::max(1, std::min(colorCount, 255))) {}
+
+std::vector<Color> MedianCutQuantizer::createPalette(const ImageData& img) {
+    std::vector<WeightedColor> colors = colorHistogram(img);
+    return medianCut(colors, colorCount);
+}
+
+// K-means
+
+KMeansQuantizer::KMeansQuantizer(int colorCount, int iterations)
+    : colorCount(std::max(1, std::min(colorCount, 255))), iterations(iterations) {}
+
+std::vector<Color> KMeansQuantizer::createPalette(const ImageData& img) {
+    std::vector<WeightedColor> colors = colorHistogram(img);
+    std::vector<Color> initial = medianCut(colors, colorCount);
+
+    std::vector<WeightedColor> centers;
+    for (const Color& color : initial) {
+        centers.push_back({ (double)color.r, (double)color.g, (double)color.b, 0 });
+    }
+    std::vector<int> assignment(colors.size(), -1);
+    std::vector<double> sums(centers.size() * 3);
+    std::vector<uint64_t> counts(centers.size());
+
+    for (int iteration = 0; iteration < iterations; iteration++) {
+        bool changed = false;
+        std::fill(sums.begin(), sums.end(), 0.0);
+        std::fill(counts.begin(), counts.end(), 0);
+
+        // Assign every color to the nearest center
+        for (int k = 0; k < colors.size(); k++) {
+            int best = 0;
+            double bestDistance = -1;
+            for (int c = 0; c < centers.size(); c++) {
+                double dr = colors[k].r - centers[c].r, dg = colors[k].g - centers[c].g, db = colors[k].b - centers[c].b;
+                double distance = dr * dr + dg * dg + db * db;
+                if (bestDistance < 0 || distance < bestDistance) {
+                    best = c;
+                    bestDistance = distance;
+                }
+            }
+            if (assignment[k] != best) {
+                assignment[k] = best;
+                changed = true;
+            }
+            sums[best * 3] += colors[k].r * colors[k].count;
+            sums[best * 3 + 1] += colors[k].g * colors[k].count;
+            sums[best * 3 + 2] += colors[k].b * colors[k].count;
+            counts[best] += colors[k].count;
+        }
+        if (!changed) {
+            break;
+        }
+
+        // Move the centers to the mean of their colors, empty clusters stay where they are
+        for (int c = 0; c < centers.size(); c++) {
+            if (counts[c] > 0) {
+                centers[c].r = sums[c * 3] / counts[c];
+                centers[c].g = sums[c * 3 + 1] / counts[c];
+                centers[c].b = sums[c * 3 + 2] / counts[c];
+            }
+        }
+    }
+
+    std::vector<Color> palette;
+    for (const WeightedColor& center : centers) {
+        palette.push_back(toColor(center.r, center.g, center.b));
+    }
+    return palette;
+}
+
+// Nearest palette color
+
+static uint8_t nearestColor(int r, int g, int b, const std::vector<Color>& palette) {
+    int best = 0, bestDistance = -1;
+    for (int c = 0; c < palette.size(); c++) {
+        int dr = r - palette[c].r, dg = g - palette[c].g, db = b - palette[c].b;
+        int distance = dr * dr + dg * dg + db * db;
+        if (bestDistance < 0 || distance < bestDistance) {
+            best = c;
+            bestDistance = distance;
+        }
+    }
+    return (uint8_t)best;
+}
+
+void ColorQuantizer::quantizeRow(const uint8_t* rgb, int width, const std::vector<Color>& palette, uint8_t* out) {
+    for (int x = 0; x < width; x++, rgb += 3) {
+        out[x] = nearestColor(rgb[0], rgb[1], rgb[2], palette);
+    }
+}
+
+void mapToPalette(const ImageData& img, const std::vector<Color>& palette, Grid<uint8_t>& array) {
+    // With a few colors the distance loop is about as cheap as a cache lookup. Larger palettes
+    // keep the last exact color and its index for each 15 bit color and search only on a miss.
+    bool cached = palette.size() > 4;
+    struct CacheEntry {
+        uint32_t rgb;
+        uint8_t index;
+    };
+    std::vector<CacheEntry> cache(cached ? 32768 : 0, CacheEntry{ 0xFFFFFFFF, 0 });
+
+    for (int y = 0; y < img.height; y++) {
+        const uint8_t* pixel = img.pixels + (size_t)y * img.width * 3;
+        uint8_t* out = array[y + 1] + 1;
+        for (int x = 0; x < img.width; x++, pixel += 3) {
+            if (!cached) {
+                out[x] = nearestColor(pixel[0], pixel[1], pixel[2], palette);
+                continue;
+            }
+            uint32_t rgb = (pixel[0] << 16) | (pixel[1] << 8) | pixel[2];
+            CacheEntry& entry = cache[((pixel[0] >> 3) << 10) | ((pixel[1] >> 3) << 5) | (pixel[2] >> 3)];
+            if (entry.rgb != rgb) {
+                entry.rgb = rgb;
+                entry.index = nearestColor(pixel[0], pixel[1], pixel[2], palette);
+            }
+            out[x] = entry.index;
+        }
+    }
+}
+
+std::shared_ptr<ColorQuantizer> createColorQuantizer(const TracerOptions& options) {
+    switch (options.quantization) {
+        case QuantizationMethod::MedianCut:
+            return std::make_shared<MedianCutQuantizer>(options.colorCount);
+        case QuantizationMethod::KMeans:
+            return std::make_shared<KMeansQuantizer>(options.colorCount);
+        default:
+            return std::make_shared<ThresholdQuantizer>(options.threshold, options.thresholdChannel);
+    }
+}
+
+}
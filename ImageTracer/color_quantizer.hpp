@@ -0,0 +1,98 @@
+//
+//  color_quantizer.hpp
+//  ImageTracer
+//
+
+#ifndef color_quantizer_hpp
+#define color_quantizer_hpp
+
+#include "image_tracer.hpp"
+
+namespace IMGTrace
+{
+
+// Creates the palette of an image and the indexed color array.
+// Subclasses only have to create the palette, pixels are mapped to the nearest palette color.
+class ColorQuantizer {
+public:
+    virtual ~ColorQuantizer() {}
+
+    // array is (width+2)*(height+2) sized with boundaryIndex around the image,
+    // pixel (x, y) is stored in array[y+1][x+1]
+    virtual void quantize(const ImageData& img, std::vector<Color>& palette, Grid<uint8_t>& array);
+
+    // Quantizers with a palette that doesn't depend on the pixels can map streamed rows one by one.
+    // Returns false if the palette needs the whole image.
+    virtual bool fixedPalette(std::vector<Color>& palette) { return false; }
+    // Stores the palette index of width RGB pixels in out, the palette comes from fixedPalette
+    virtual void quantizeRow(const uint8_t* rgb, int width, const std::vector<Color>& palette, uint8_t* out);
+
+protected:
+    virtual std::vector<Color> createPalette(const ImageData& img) = 0;
+};
+
+// Black and white, index 0 is light and 1 is dark
+class ThresholdQuantizer : public ColorQuantizer {
+public:
+    // Pixels with 255 - value < threshold are light
+    explicit ThresholdQuantizer(int threshold = 20, ThresholdChannel channel = ThresholdChannel::Luminance);
+
+    void quantize(const ImageData& img, std::vector<Color>& palette, Grid<uint8_t>& array) override;
+    bool fixedPalette(std::vector<Color>& palette) override;
+    void quantizeRow(const uint8_t* rgb, int width, const std::vector<Color>& palette, uint8_t* out) override;
+
+protected:
+    std::vector<Color> createPalette(const ImageData& img) override;
+
+private:
+    int threshold;
+    ThresholdChannel channel;
+};
+
+// Caller supplied palette of 1 to 255 colors, an empty palette becomes black
+class PaletteQuantizer : public ColorQuantizer {
+public:
+    explicit PaletteQuantizer(std::vector<Color> palette);
+
+    bool fixedPalette(std::vector<Color>& palette) override;
+
+protected:
+    std::vector<Color> createPalette(const ImageData& img) override;
+
+private:
+    std::vector<Color> palette;
+};
+
+// Recursively splits the color box with the most pixels at the median of its longest axis
+class MedianCutQuantizer : public ColorQuantizer {
+public:
+    explicit MedianCutQuantizer(int colorCount);
+
+protected:
+    std::vector<Color> createPalette(const ImageData& img) override;
+
+private:
+    int colorCount;
+};
+
+// Lloyd's k-means on the color histogram, starting from the median cut palette
+class KMeansQuantizer : public ColorQuantizer {
+public:
+    explicit KMeansQuantizer(int colorCount, int iterations = 16);
+
+protected:
+    std::vector<Color> createPalette(const ImageData& img) override;
+
+private:
+    int colorCount, iterations;
+};
+
+// Stores the index of the nearest palette color of every pixel in array
+void mapToPalette(const ImageData& img, const std::vector<Color>& palette, Grid<uint8_t>& array);
+
+// Quantizer selected by options.quantization
+std::shared_ptr<ColorQuantizer> createColorQuantizer(const TracerOptions& options);
+
+}
+
+#endif /* color_quantizer_hpp */
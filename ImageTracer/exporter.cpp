@@ -0,0 +1,161 @@
+//
+//  exporter.cpp
+//  ImageTracer
+//
+
+#include "exporter.hpp"
+#include "svg_writer.hpp"
+
+#if IMGTRACE_PDF
+#include "pdfgen.h"
+#include <sys/stat.h>
+#endif
+
+namespace IMGTrace
+{
+
+// SVG
+
+SvgExporter::SvgExporter(OutputSink& sink) : sink(sink) {}
+
+bool SvgExporter::exportImage(const IndexedImage& ii, const TracerOptions& options) {
+    float scale = options.scale;
+    int w = (int) (ii.width * scale), h = (int) (ii.height * scale);
+    SvgWriter writer(sink, scale, options.precision, options.relativePaths);
+    writer.begin(w, h);
+
+    // Drawing
+    // Z-order loop
+    for (const PathRef& ref : ii.zorder) {
+        writer.path(ii.layers[ref.layer][ref.path], ii.palette[ref.layer]);
+    }
+
+    if (!writer.end()) {
+        fprintf(stderr, "SVG Error: writing the output failed\n");
+        return false;
+    }
+    return true;
+}
+
+// Binary trace
+
+TraceExporter::TraceExporter(OutputSink& sink, TraceCoordinates coordinates, int fractionBits)
+    : sink(sink), coordinates(coordinates), fractionBits(fractionBits) {}
+
+bool TraceExporter::exportImage(const IndexedImage& ii, const TracerOptions& options) {
+    if (!writeTrace(ii, options.scale, sink, coordinates, fractionBits)) {
+        fprintf(stderr, "Trace Error: writing the output failed\n");
+        return false;
+    }
+    return true;
+}
+
+#if IMGTRACE_PDF
+
+// PDF
+
+// Appends the operations of a closed path, quadratic segments become cubic ones.
+// Returns twice the signed area of the polygon through the segment end points.
+template <class Snap>
+static double appendPathOperations(const std::vector<Segment>& segments, const Snap& snap, float h,
+                                   std::vector<pdf_path_operation>& operations) {
+    float curr_x, prev_x = snap(segments[0].x1);
+    float curr_y, prev_y = snap(segments[0].y1);
+    double area2 = 0.0;
+
+    operations.push_back({ .op = 'm', .x1 = prev_x, .y1 = h - prev_y });
+
+    for (int pcnt = 0; pcnt < segments.size(); pcnt++) {
+        if (segments[pcnt].type == SegmentType::Line) {
+            curr_x = snap(segments[pcnt].x2);
+            curr_y = snap(segments[pcnt].y2);
+            operations.push_back({ .op = 'l', .x1 = curr_x, .y1 = h - curr_y });
+        } else {
+            curr_x = snap(segments[pcnt].x3);
+            curr_y = snap(segments[pcnt].y3);
+            float xq1 = snap(segments[pcnt].x2);
+            float yq1 = snap(segments[pcnt].y2);
+            
+            float xc1 = prev_x + (xq1 - prev_x) * (2.0 / 3.0);
+            float yc1 = prev_y + (yq1 - prev_y) * (2.0 / 3.0);
+            float xc2 = curr_x + (xq1 - curr_x) * (2.0 / 3.0);
+            float yc2 = curr_y + (yq1 - curr_y) * (2.0 / 3.0);
+            
+            operations.push_back({ .op = 'c', .x1 = xc1, .y1 = h - yc1,
+                .x2 = xc2, .y2 = h - yc2, .x3 = curr_x, .y3 = h - curr_y
+            });
+        }
+        area2 += (double)prev_x * curr_y - (double)curr_x * prev_y;
+        prev_x = curr_x;
+        prev_y = curr_y;
+    }
+    
+    operations.push_back({ .op = 'h' });
+    return area2;
+}
+
+PdfExporter::PdfExporter(std::string path) : path(std::move(path)) {}
+
+bool PdfExporter::exportImage(const IndexedImage& ii, const TracerOptions& options) {
+    float scale = options.scale;
+    int w = (int) (ii.width * scale), h = (int) (ii.height * scale);
+    struct pdf_info info = { .creator = "", .producer = "",
+        .title = "", .author = "", .subject = "" };
+    struct pdf_doc *pdf = pdf_create(w, h, &info);
+    pdf_append_page(pdf);
+    
+    // Same rounding as the SVG coordinates, cubic control points are derived from the rounded ones
+    int precision = options.precision;
+    auto snap = [scale, precision](float value) {
+        return (float)roundCoordinate(value * scale, precision);
+    };
+
+    // Consecutive paths of a color are drawn as one path with a subpath for each. The nonzero
+    // fill of subpaths turning the same way is their union, so a path turning the other way
+    // starts a new batch. Both operation buffers are reused for every path.
+    std::vector<pdf_path_operation> operations, pathOperations;
+    int batchLayer = -1;
+    double batchArea = 0.0;
+    batches = 0;
+    auto addBatch = [&]() {
+        if (operations.empty()) {
+            return;
+        }
+        const Color& color = ii.palette[batchLayer];
+        uint32_t fill_color = PDF_RGB(color.r, color.g, color.b);
+        pdf_add_custom_path(pdf, NULL, operations.data(), (int)operations.size(), 1, fill_color, fill_color);
+        operations.clear();
+        batches++;
+    };
+    
+    for (const PathRef& ref : ii.zorder) {
+        pathOperations.clear();
+        double area2 = appendPathOperations(ii.layers[ref.layer][ref.path], snap, h, pathOperations);
+        if ((int)ref.layer != batchLayer || area2 * batchArea <= 0.0) {
+            addBatch();
+            batchLayer = ref.layer;
+            batchArea = area2;
+        }
+        operations.insert(operations.end(), pathOperations.begin(), pathOperations.end());
+    }
+    addBatch();
+    
+    pdf_save(pdf, path.c_str());
+        
+    int err;
+    const char *err_str = pdf_get_err(pdf, &err);
+    if (err_str) {
+        fprintf(stderr, "PDF Error: %d - %s\n", err, err_str);
+    }
+    pdf_destroy(pdf);
+
+    struct stat file;
+    paths = (long)ii.zorder.size();
+    bytes = stat(path.c_str(), &file) == 0 ? (long)file.st_size : 0;
+    printf("ImageTracer - PDF: %ld paths in %ld batches, %ld bytes\n", paths, batches, bytes);
+    return err_str == NULL;
+}
+
+#endif
+
+}
@@ -0,0 +1,77 @@
+//
+//  exporter.hpp
+//  ImageTracer
+//
+
+#ifndef exporter_hpp
+#define exporter_hpp
+
+#include "image_tracer.hpp"
+#include "output_sink.hpp"
+#include "trace_format.hpp"
+
+// PdfExporter needs PDFGen, builds without the PDFGen submodule define IMGTRACE_PDF=0
+#ifndef IMGTRACE_PDF
+#define IMGTRACE_PDF 1
+#endif
+
+namespace IMGTrace
+{
+
+// Output format of a traced image. ImageTracer traces an image once and passes the result
+// to every exporter the caller selected.
+class Exporter {
+public:
+    virtual ~Exporter() {}
+
+    // ii.layers and ii.zorder are filled, the output options (scale, precision, relativePaths)
+    // come from the tracer. Returns false if the output could not be written.
+    virtual bool exportImage(const IndexedImage& ii, const TracerOptions& options) = 0;
+};
+
+// SVG document written to a sink
+class SvgExporter : public Exporter {
+public:
+    explicit SvgExporter(OutputSink& sink);
+
+    bool exportImage(const IndexedImage& ii, const TracerOptions& options) override;
+
+private:
+    OutputSink& sink;
+};
+
+// Binary trace, see trace_format.hpp
+class TraceExporter : public Exporter {
+public:
+    explicit TraceExporter(OutputSink& sink, TraceCoordinates coordinates = TraceCoordinates::Float, int fractionBits = 8);
+
+    bool exportImage(const IndexedImage& ii, const TracerOptions& options) override;
+
+private:
+    OutputSink& sink;
+    TraceCoordinates coordinates;
+    int fractionBits;
+};
+
+#if IMGTRACE_PDF
+// Single page PDF document saved by PDFGen
+class PdfExporter : public Exporter {
+public:
+    explicit PdfExporter(std::string path);
+
+    bool exportImage(const IndexedImage& ii, const TracerOptions& options) override;
+
+    // Counts of the last export
+    long getPathCount() const { return paths; }
+    long getBatchCount() const { return batches; } // drawing operations, consecutive paths of a color are drawn together
+    long getByteCount() const { return bytes; }
+
+private:
+    std::string path;
+    long paths = 0, batches = 0, bytes = 0;
+};
+#endif
+
+}
+
+#endif /* exporter_hpp */
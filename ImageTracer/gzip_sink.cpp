@@ -0,0 +1,303 @@
+//
+//  gzip_sink.cpp
+//  ImageTracer
+//
+
+#include "gzip_sink.hpp"
+#include <algorithm>
+
+namespace IMGTrace
+{
+
+static const size_t windowSize = 32 * 1024; // farthest match distance of deflate
+static const size_t blockSize = 64 * 1024; // input compressed as one block
+static const size_t outputSize = 64 * 1024;
+static const int hashBits = 15;
+static const int minMatch = 3, maxMatch = 258;
+static const int maxChain = 64; // candidates compared for each match
+
+static const uint16_t lengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t lengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t distanceBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+    4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t distanceExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// Fixed Huffman codes of deflate, bit reversed so they are written from the lowest bit
+struct FixedCodes {
+    uint16_t symbol[288];
+    uint8_t symbolLength[288];
+    uint8_t distance[30];
+    uint8_t lengthCode[maxMatch + 1]; // index into lengthBase
+
+    FixedCodes() {
+        for (int s = 0; s < 288; s++) {
+            uint32_t code;
+            int length;
+            if (s < 144) {
+                code = 0x30 + s; length = 8;
+            } else if (s < 256) {
+                code = 0x190 + (s - 144); length = 9;
+            } else if (s < 280) {
+                code = s - 256; length = 7;
+            } else {
+                code = 0xC0 + (s - 280); length = 8;
+            }
+            symbol[s] = (uint16_t)reverse(code, length);
+            symbolLength[s] = (uint8_t)length;
+        }
+        for (int d = 0; d < 30; d++) {
+            distance[d] = (uint8_t)reverse(d, 5);
+        }
+        int code = 0;
+        for (int length = minMatch; length <= maxMatch; length++) {
+            while (code < 28 && length >= lengthBase[code + 1]) {
+                code++;
+            }
+            lengthCode[length] = (uint8_t)code;
+        }
+    }
+
+    static uint32_t reverse(uint32_t code, int length) {
+        uint32_t reversed = 0;
+        for (int k = 0; k < length; k++) {
+            reversed = (reversed << 1) | ((code >> k) & 1);
+        }
+        return reversed;
+    }
+};
+
+static const FixedCodes& fixedCodes() {
+    static const FixedCodes codes;
+    return codes;
+}
+
+uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc) {
+    static const struct CrcTable {
+        uint32_t entries[256];
+        CrcTable() {
+            for (uint32_t n = 0; n < 256; n++) {
+                uint32_t c = n;
+                for (int k = 0; k < 8; k++) {
+                    c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                }
+                entries[n] = c;
+            }
+        }
+    } table;
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = table.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static inline uint32_t hash3(const uint8_t* p) {
+    uint32_t v = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+    return (v * 2654435761u) >> (32 - hashBits);
+}
+
+GzipSink::GzipSink(OutputSink& sink)
+    : sink(sink), head((size_t)1 << hashBits, 0), prev(windowSize, 0) {
+    window.reserve(windowSize + blockSize);
+    output.reserve(outputSize + 1024);
+    // Header without a file name or time stamp, written on the first flush
+    static const uint8_t header[10] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 3 };
+    output.insert(output.end(), header, header + sizeof(header));
+}
+
+GzipSink::~GzipSink() {
+    finish();
+}
+
+void GzipSink::putBits(uint32_t value, int count) {
+    bits |= (uint64_t)value << bitCount;
+    bitCount += count;
+    while (bitCount >= 8) {
+        output.push_back((uint8_t)bits);
+        bits >>= 8;
+        bitCount -= 8;
+    }
+}
+
+void GzipSink::literal(uint8_t value) {
+    const FixedCodes& codes = fixedCodes();
+    putBits(codes.symbol[value], codes.symbolLength[value]);
+}
+
+void GzipSink::match(int length, int distance) {
+    const FixedCodes& codes = fixedCodes();
+    int lc = codes.lengthCode[length];
+    putBits(codes.symbol[257 + lc], codes.symbolLength[257 + lc]);
+    putBits(length - lengthBase[lc], lengthExtra[lc]);
+    int dc = (int)(std::upper_bound(distanceBase, distanceBase + 30, distance) - distanceBase) - 1;
+    putBits(codes.distance[dc], 5);
+    putBits(distance - distanceBase[dc], distanceExtra[dc]);
+}
+
+void GzipSink::alignToByte() {
+    if (bitCount > 0) {
+        putBits(0, 8 - bitCount);
+    }
+}
+
+// Compresses window[pending, end) as one fixed Huffman block and keeps the last 32 KiB as history
+void GzipSink::compressPending() {
+    const FixedCodes& codes = fixedCodes();
+    const uint8_t* data = window.data();
+    size_t end = window.size();
+    putBits(0, 1); // not the last block
+    putBits(1, 2); // fixed Huffman codes
+
+    auto insert = [&](size_t p) {
+        if (end - p >= (size_t)minMatch) {
+            uint32_t h = hash3(data + p);
+            uint64_t position = windowStart + p;
+            prev[position & (windowSize - 1)] = head[h];
+            head[h] = position + 1;
+        }
+    };
+
+    size_t p = pending;
+    while (p < end) {
+        int bestLength = 0;
+        uint64_t bestDistance = 0;
+        if (end - p >= (size_t)minMatch) {
+            uint64_t position = windowStart + p;
+            uint64_t candidate = head[hash3(data + p)];
+            int limit = (int)std::min(end - p, (size_t)maxMatch);
+            for (int chain = 0; chain < maxChain && candidate != 0; chain++) {
+                uint64_t start = candidate - 1;
+                uint64_t distance = position - start;
+                if (distance > windowSize) {
+                    break;
+                }
+                const uint8_t* a = data + (start - windowStart);
+                const uint8_t* b = data + p;
+                if (a[bestLength] == b[bestLength]) {
+                    int length = 0;
+                    while (length < limit && a[length] == b[length]) {
+                        length++;
+                    }
+                    if (length > bestLength) {
+                        bestLength = length;
+                        bestDistance = distance;
+                        if (length == limit) {
+                            break;
+                        }
+                    }
+                }
+                uint64_t next = prev[start & (windowSize - 1)];
+                // Older entries of the slot were replaced by newer positions
+                if (next >= candidate) {
+                    break;
+                }
+                candidate = next;
+            }
+        }
+
+        if (bestLength >= minMatch) {
+            match(bestLength, (int)bestDistance);
+            for (int k = 0; k < bestLength; k++) {
+                insert(p + k);
+            }
+            p += bestLength;
+        } else {
+            literal(data[p]);
+            insert(p);
+            p++;
+        }
+    }
+    putBits(codes.symbol[256], codes.symbolLength[256]);
+
+    size_t keep = std::min(end, windowSize);
+    window.erase(window.begin(), window.begin() + (end - keep));
+    windowStart += end - keep;
+    pending = window.size();
+    if (output.size() >= outputSize) {
+        flushOutput();
+    }
+}
+
+void GzipSink::flushOutput() {
+    if (!output.empty() && !failed && !sink.write((const char*)output.data(), output.size())) {
+        failed = true;
+    }
+    output.clear();
+}
+
+bool GzipSink::write(const char* data, size_t size) {
+    if (finished) {
+        return false;
+    }
+    crc = crc32((const uint8_t*)data, size, crc);
+    inputSize += size;
+    while (size > 0) {
+        size_t count = std::min(size, pending + blockSize - window.size());
+        window.insert(window.end(), data, data + count);
+        data += count;
+        size -= count;
+        if (window.size() - pending == blockSize) {
+            compressPending();
+        }
+    }
+    return !failed;
+}
+
+bool GzipSink::flush() {
+    if (finished) {
+        return !failed;
+    }
+    if (window.size() > pending) {
+        compressPending();
+    }
+    // Empty stored block, so everything written so far can be decompressed
+    putBits(0, 3);
+    alignToByte();
+    static const uint8_t marker[4] = { 0, 0, 0xFF, 0xFF };
+    output.insert(output.end(), marker, marker + sizeof(marker));
+    flushOutput();
+    if (!failed && !sink.flush()) {
+        failed = true;
+    }
+    return !failed;
+}
+
+bool GzipSink::finish() {
+    if (finished) {
+        return !failed;
+    }
+    if (window.size() > pending) {
+        compressPending();
+    }
+    // Empty last block
+    const FixedCodes& codes = fixedCodes();
+    putBits(1, 1);
+    putBits(1, 2);
+    putBits(codes.symbol[256], codes.symbolLength[256]);
+    alignToByte();
+
+    uint32_t size = (uint32_t)inputSize; // modulo 2^32
+    for (int k = 0; k < 4; k++) {
+        output.push_back((uint8_t)(crc >> (8 * k)));
+    }
+    for (int k = 0; k < 4; k++) {
+        output.push_back((uint8_t)(size >> (8 * k)));
+    }
+    flushOutput();
+    if (!failed && !sink.flush()) {
+        failed = true;
+    }
+    finished = true;
+    window.clear();
+    return !failed;
+}
+
+}
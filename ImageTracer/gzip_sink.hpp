@@ -0,0 +1,64 @@
+//
+//  gzip_sink.hpp
+//  ImageTracer
+//
+
+#ifndef gzip_sink_hpp
+#define gzip_sink_hpp
+
+#include "output_sink.hpp"
+#include <stdint.h>
+#include <vector>
+
+namespace IMGTrace
+{
+
+// Compresses the bytes into a gzip stream written to another sink, an SVG written through it
+// is an SVGZ file. Input is compressed in blocks as it arrives, with LZ77 matches and the fixed
+// Huffman codes of deflate, so the document is never held in memory as a whole.
+class GzipSink : public OutputSink {
+public:
+    explicit GzipSink(OutputSink& sink);
+    // Finishes the stream if finish wasn't called
+    ~GzipSink() override;
+
+    GzipSink(const GzipSink&) = delete;
+    GzipSink& operator=(const GzipSink&) = delete;
+
+    bool write(const char* data, size_t size) override;
+    // Compresses the pending bytes and passes the output to the sink, the stream stays open
+    bool flush() override;
+    // Writes the last block and the gzip trailer, later writes fail
+    bool finish();
+
+private:
+    OutputSink& sink;
+    // The last 32 KiB of input for matches, followed by the input not compressed yet
+    std::vector<uint8_t> window;
+    size_t pending = 0; // start of the uncompressed input in window
+    uint64_t windowStart = 0; // stream position of window[0]
+    // Hash chains of 3 byte sequences, stream positions + 1 so 0 is empty
+    std::vector<uint64_t> head, prev;
+    std::vector<uint8_t> output;
+    uint64_t bits = 0;
+    int bitCount = 0;
+    uint32_t crc = 0;
+    uint64_t inputSize = 0;
+    bool finished = false;
+    bool failed = false;
+
+    // Writes from the lowest bit, the Huffman code tables are bit reversed for this
+    void putBits(uint32_t value, int count);
+    void literal(uint8_t value);
+    void match(int length, int distance);
+    void alignToByte();
+    void compressPending();
+    void flushOutput();
+};
+
+// CRC-32 of gzip and PNG, pass the previous value to continue a checksum
+uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0);
+
+}
+
+#endif /* gzip_sink_hpp */
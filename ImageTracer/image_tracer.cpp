@@ -7,15 +7,93 @@
 //
 
 #include "image_tracer.hpp"
-#include "pdfgen.h"
-#include <map>
+#include "color_quantizer.hpp"
+#include "exporter.hpp"
+#include "node_rows.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <thread>
 
 namespace IMGTrace
 {
 
-ImageTracer::ImageTracer() {}
+ImageTracer::ImageTracer() : quantizer(createColorQuantizer(options)) {}
+
+ImageTracer::ImageTracer(const TracerOptions& options) : options(options), quantizer(createColorQuantizer(options)) {}
+
+ImageTracer::ImageTracer(int threadCount) : ImageTracer() {
+    options.threadCount = threadCount;
+}
+
+void ImageTracer::setOptions(const TracerOptions& options) {
+    this->options = options;
+    quantizer = createColorQuantizer(options);
+}
+
+const TracerOptions& ImageTracer::getOptions() const {
+    return options;
+}
+
+void ImageTracer::setColorQuantizer(std::shared_ptr<ColorQuantizer> quantizer) {
+    this->quantizer = quantizer;
+}
+
+const TraceStats& ImageTracer::getStats() const {
+    return stats;
+}
+
+int ImageTracer::workerCount() const {
+    if (options.threadCount > 0) {
+        return options.threadCount;
+    }
+    int hardwareThreads = (int)std::thread::hardware_concurrency();
+    return hardwareThreads > 0 ? hardwareThreads : 1;
+}
+
+// Runs job(0) ... job(jobCount-1) on up to threadCount threads including the calling one.
+// Idle threads take the next job from a shared counter, so jobs start in index order.
+static void parallelFor(int jobCount, int threadCount, const std::function<void(int)>& job) {
+    if (threadCount > jobCount) {
+        threadCount = jobCount;
+    }
+    if (threadCount <= 1) {
+        for (int i = 0; i < jobCount; i++) {
+            job(i);
+        }
+        return;
+    }
+
+    std::atomic<int> nextJob(0);
+    auto worker = [&]() {
+        for (int i = nextJob++; i < jobCount; i = nextJob++) {
+            job(i);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 1; t < threadCount; t++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
 
 std::stringstream ImageTracer::processImage(uint8_t* pixels, int width, int height) {
+    StringSink sink;
+    processImage(pixels, width, height, sink);
+    return std::stringstream(sink.str());
+}
+
+bool ImageTracer::processImage(uint8_t* pixels, int width, int height, OutputSink& sink) {
+    SvgExporter svg(sink);
+    return processImage(pixels, width, height, { &svg });
+}
+
+bool ImageTracer::processImage(uint8_t* pixels, int width, int height, const std::vector<Exporter*>& exporters) {
     ImageData data = {
         .width = width,
         .height = height,
@@ -24,56 +102,68 @@ std::stringstream ImageTracer::processImage(uint8_t* pixels, int width, int heig
     
     printf("ImageTracer - Color quantization\n");
     IndexedImage ii = colorQuantization(data);
-    printf("ImageTracer - Creating layers\n");
-    threeDim<int> layers = layering(ii);
-    printf("ImageTracer - Scanning paths\n");
-    fourDim<int> pathScans = batchPathScan(layers);
-    printf("ImageTracer - Interpolating nodes\n");
-    fourDim<double> binternodes = batchInternodes(pathScans);
+    threeDim<Internode> binternodes;
+    if (options.tileSize > 0) {
+        printf("ImageTracer - Creating layers in tiles\n");
+        binternodes = scanPaths(tiledLayering(ii));
+    } else {
+        printf("ImageTracer - Creating layers\n");
+        binternodes = scanPaths(layering(ii));
+    }
+    return traceAndExport(ii, std::move(binternodes), exporters);
+}
+
+bool ImageTracer::traceAndExport(IndexedImage& ii, threeDim<Internode> binternodes, const std::vector<Exporter*>& exporters) {
     printf("ImageTracer - Tracing layers\n");
-    fourDim<double> tracedLayers = batchTraceLayers(binternodes, 10.0f, 10.0f);
-    ii.layers = tracedLayers;
+    ii.layers = batchTraceLayers(binternodes, options.ltres, options.qtres);
+    binternodes.clear();
+    createZOrder(ii);
     printf("ImageTracer - Done\n");
-    
-    exportPDF(ii);
-    return toSvgStringStream(ii);
+
+    bool exported = true;
+    for (Exporter* exporter : exporters) {
+        exported = exporter->exportImage(ii, options) && exported;
+    }
+    return exported;
+}
+
+// Steps 3. and 4., fused if options.fusedScan is set
+template <class Layer>
+threeDim<Internode> ImageTracer::scanPaths(std::vector<Layer> layers) {
+    threeDim<Internode> binternodes;
+    if (options.fusedScan) {
+        printf("ImageTracer - Scanning paths and interpolating nodes\n");
+        binternodes = batchPathScanInternodes(std::move(layers));
+        printf("ImageTracer - Omitted %ld of %ld paths\n", stats.pathsOmittedByLength + stats.pathsOmittedByArea, stats.pathsScanned);
+    } else {
+        printf("ImageTracer - Scanning paths\n");
+        threeDim<PathPoint> pathScans = batchPathScan(std::move(layers));
+        printf("ImageTracer - Omitted %ld of %ld paths\n", stats.pathsOmittedByLength + stats.pathsOmittedByArea, stats.pathsScanned);
+        printf("ImageTracer - Interpolating nodes\n");
+        binternodes = batchInternodes(pathScans);
+    }
+    return binternodes;
 }
 
+// Both layer types are scanned here, the tests also scan them directly
+template threeDim<Internode> ImageTracer::scanPaths(std::vector<NodeGrid> layers);
+template threeDim<Internode> ImageTracer::scanPaths(std::vector<SparseNodeGrid> layers);
+
 // 1. Color quantization
-IndexedImage ImageTracer::colorQuantization(ImageData img) {
-    // Only check for black and white colors
-    int colorCount = 2;
-    std::vector<Color> palette(colorCount);
-    palette[0] = {
-        .r = 0, .g = 0, .b = 0, .a = 255
-    };
-    palette[1] = {
-        .r = 255, .g = 255, .b = 255, .a = 255
-    };
+IndexedImage ImageTracer::colorQuantization(const ImageData& img) {
+    std::vector<Color> palette;
 
-    // Creating indexed color array which has a boundary filled with -1 in every direction
-    twoDim<int> array(img.height+2, std::vector<int>(img.width+2,-1));
-
-    for(unsigned int i = 1; i < img.width+1; ++i){
-        for(unsigned int j = 1; j < img.height+1; ++j){
-            uint8_t* pixel = &img.pixels[((i-1)+((j-1)*img.width))*3];
-            uint8_t a = 255 - pixel[0]; //R
-            //uint8_t b = 255 - pixel[1]; //G
-            //uint8_t c = 255 - pixel[2]; //B
-            if (a < 20) {
-                array[j][i] = 0;
-            } else {
-                array[j][i] = 1;
-            }
-        }
-    }
+    // Creating indexed color array which has a boundary filled with boundaryIndex in every direction
+    Grid<uint8_t> array(img.width+2, img.height+2, boundaryIndex);
+
+    quantizer->quantize(img, palette, array);
     
     IndexedImage ii = {
         .width = img.width+2,
         .height = img.height+2,
-        .array = array,
-        .palette = palette,
-        .colorCount = colorCount
+        .colorCount = (int)palette.size(),
+        .palette = std::move(palette),
+        .array = std::move(array)
     };
     
     return ii;
@@ -84,42 +174,357 @@ IndexedImage ImageTracer::colorQuantization(ImageData img) {
 // 12  ░░  ▓░  ░▓  ▓▓  ░░  ▓░  ░▓  ▓▓  ░░  ▓░  ░▓  ▓▓  ░░  ▓░  ░▓  ▓▓
 // 48  ░░  ░░  ░░  ░░  ░▓  ░▓  ░▓  ░▓  ▓░  ▓░  ▓░  ▓░  ▓▓  ▓▓  ▓▓  ▓▓
 //     0   1   2   3   4   5   6   7   8   9   10  11  12  13  14  15
-threeDim<int> ImageTracer::layering(IndexedImage ii) {
+//
+// The edge node at layers[c].get(i, j) sits between the pixels array[j-1][i-1] (1), array[j-1][i] (2),
+// array[j][i] (4) and array[j][i-1] (8), its type is the sum of the pixels having color c.
+// Every node is computed from its own four pixels, so each cell is written by exactly one
+// iteration and horizontal stripes of node rows can be processed on separate threads.
+// Layers store two nodes per byte (see NodeGrid), a node row is one byte per two pixels.
+
+// True if either node of a packed byte is an edge node (not 0 or 15)
+static inline bool hasEdgeNode(uint8_t pair) {
+    uint8_t lo = pair & 15, hi = pair >> 4;
+    return (lo != 0 && lo != 15) || (hi != 0 && hi != 15);
+}
+
+// Up to this many colors every layer row is computed with the vector kernel, with more
+// colors only the layers of the (at most four) colors around each node are written.
+static const int vectorLayeringMaxColors = 16;
+
+// Pixel bounding box of a palette color in the indexed array, empty if x1 < x0
+struct ColorBox {
+    int x0 = INT32_MAX, y0 = INT32_MAX, x1 = -1, y1 = -1;
+
+    bool empty() const { return x1 < x0; }
+    void add(int xstart, int xend, int y) {
+        x0 = std::min(x0, xstart); x1 = std::max(x1, xend);
+        y0 = std::min(y0, y); y1 = std::max(y1, y);
+    }
+    void add(const ColorBox& box) {
+        if (!box.empty()) {
+            add(box.x0, box.x1, box.y0);
+            y1 = std::max(y1, box.y1);
+        }
+    }
+};
+
+// Bounding boxes of every color, rows are read as runs of the same color
+static std::vector<ColorBox> colorBoxes(const Grid<uint8_t>& array, int colorCount, int threads) {
+    int aw = array.width(), ah = array.height();
+    int stripeHeight = std::max(16, ah / (threads * 4));
+    int stripeCount = (ah + stripeHeight - 1) / stripeHeight;
+    std::vector<std::vector<ColorBox>> stripeBoxes(stripeCount, std::vector<ColorBox>(colorCount));
+
+    parallelFor(stripeCount, threads, [&](int stripe) {
+        std::vector<ColorBox>& boxes = stripeBoxes[stripe];
+        int rowend = std::min((stripe + 1) * stripeHeight, ah);
+        for (int j = stripe * stripeHeight; j < rowend; j++) {
+            const uint8_t* row = array[j];
+            int runstart = 0;
+            for (int i = 1; i <= aw; i++) {
+                if (i == aw || row[i] != row[runstart]) {
+                    if (row[runstart] != boundaryIndex) {
+                        boxes[row[runstart]].add(runstart, i - 1, j);
+                    }
+                    runstart = i;
+                }
+            }
+        }
+    });
+
+    std::vector<ColorBox> boxes(colorCount);
+    for (const auto& stripe : stripeBoxes) {
+        for (int c = 0; c < colorCount; c++) {
+            boxes[c].add(stripe[c]);
+        }
+    }
+    return boxes;
+}
+
+static void layerRows(const Grid<uint8_t>& array, std::vector<NodeGrid>& layers, int rowstart, int rowend) {
+    if (layers.size() <= vectorLayeringMaxColors) {
+        NodeRowKernel kernel = nodeRowKernel();
+        for(int j=rowstart; j<rowend; j++){
+            for(int c=0; c<layers.size(); c++){
+                NodeGrid& layer = layers[c];
+                if (j < layer.top() || j >= layer.top() + layer.height()) {
+                    continue;
+                }
+                // The first node of the layer is right of its left pixel column, which is inside the boundary
+                int left = layer.left();
+                kernel(array[j-1] + left - 1, array[j] + left - 1, layer[j - layer.top()], layer.width(), (uint8_t)c);
+            }
+        }
+        return;
+    }
+
+    int aw = array.width();
+    int tl, tr, br, bl;
+    for(int j=rowstart; j<rowend; j++){
+        const uint8_t* up = array[j-1];
+        const uint8_t* down = array[j];
+        for(int i=1; i<aw; i++){
+
+            // The four pixels around this node
+            tl = up[i-1]; tr = up[i]; br = down[i]; bl = down[i-1];
+
+            // Node type in the layer of each distinct color, the boundary has no layer.
+            // A pixel's four nodes are always inside the bounds of its layer.
+            if(tl!=boundaryIndex){ NodeGrid& l = layers[tl]; l.set(i - l.left(), j - l.top(), 1 + (tr==tl ? 2 : 0) + (br==tl ? 4 : 0) + (bl==tl ? 8 : 0)); }
+            if(tr!=boundaryIndex && tr!=tl){ NodeGrid& l = layers[tr]; l.set(i - l.left(), j - l.top(), 2 + (br==tr ? 4 : 0) + (bl==tr ? 8 : 0)); }
+            if(br!=boundaryIndex && br!=tl && br!=tr){ NodeGrid& l = layers[br]; l.set(i - l.left(), j - l.top(), 4 + (bl==br ? 8 : 0)); }
+            if(bl!=boundaryIndex && bl!=tl && bl!=tr && bl!=br){ NodeGrid& l = layers[bl]; l.set(i - l.left(), j - l.top(), 8); }
+
+        }
+    }
+}
+
+std::vector<NodeGrid> ImageTracer::layering(const IndexedImage& ii) {
     // Creating layers for each indexed color in arr
-    //int val=0, aw = ii.array[0].length, ah = ii.array.length, n1,n2,n3,n4,n5,n6,n7,n8;
-    int val=0, aw = ii.width, ah = ii.height, n1,n2,n3,n4,n5,n6,n7,n8;
-    
-    threeDim<int> layers(ii.colorCount, twoDim<int>(ah, std::vector<int>(aw)));
+    int ah = ii.height;
+    int threads = workerCount();
+
+    // Layers only cover the nodes around the pixels of their color, absent colors get an empty layer.
+    // The pixels in the box (x0, y0) - (x1, y1) have the nodes (x0, y0) - (x1+1, y1+1).
+    std::vector<ColorBox> boxes = colorBoxes(ii.array, ii.colorCount, threads);
+    std::vector<NodeGrid> layers(ii.colorCount);
+    for (int c = 0; c < ii.colorCount; c++) {
+        const ColorBox& box = boxes[c];
+        if (!box.empty()) {
+            layers[c] = NodeGrid(box.x1 - box.x0 + 2, box.y1 - box.y0 + 2, box.x0, box.y0);
+        }
+    }
+
+    // Node rows 1 ... ah-1 in stripes, a few per thread to even out the load
+    int rows = ah - 1;
+    int stripeHeight = std::max(16, rows / (threads * 4));
+    int stripeCount = (rows + stripeHeight - 1) / stripeHeight;
+
+    parallelFor(stripeCount, threads, [&](int stripe) {
+        int rowstart = 1 + stripe * stripeHeight;
+        layerRows(ii.array, layers, rowstart, std::min(rowstart + stripeHeight, ah));
+    });
+
+    return layers;
+}
+
+// 2.b Tiled layer separation: the nodes are computed tile by tile and only the edge nodes are kept,
+// so no full size layer is allocated. Each row of tiles is merged into the sparse layers before
+// the next one is computed, node rows are appended tile after tile, so the layers list the edge
+// nodes in the same raster order as the dense ones. Paths crossing tile borders are walked as
+// single paths by the scan and the output is the same as without tiles.
 
-    // Looping through all pixels and calculating edge node type
-    for(int j=1; j<(ah-1); j++){
-        for(int i=1; i<(aw-1); i++){
+// Edge nodes of one layer in a tile, rowEnd[j] is the end of tile row j in xs and types
+struct TileNodes {
+    std::vector<int32_t> xs;
+    std::vector<uint8_t> types;
+    std::vector<int> rowEnd;
+};
 
-            // This pixel's indexed color
-            val = ii.array[j][i];
+// Appends the edge nodes of a packed node row starting at node x
+static void appendEdgeNodes(const uint8_t* packed, int x, int count, TileNodes& out) {
+    for (int k = 0; k < count; k += 2) {
+        uint8_t pair = packed[k >> 1];
+        if (!hasEdgeNode(pair)) {
+            continue;
+        }
+        uint8_t lo = pair & 15, hi = pair >> 4;
+        if (lo != 0 && lo != 15) {
+            out.xs.push_back(x + k); out.types.push_back(lo);
+        }
+        if (k + 1 < count && hi != 0 && hi != 15) {
+            out.xs.push_back(x + k + 1); out.types.push_back(hi);
+        }
+    }
+}
 
-            // Are neighbor pixel colors the same?
-            n1 = ii.array[j-1][i-1]==val ? 1 : 0;
-            n2 = ii.array[j-1][i  ]==val ? 1 : 0;
-            n3 = ii.array[j-1][i+1]==val ? 1 : 0;
-            n4 = ii.array[j  ][i-1]==val ? 1 : 0;
-            n5 = ii.array[j  ][i+1]==val ? 1 : 0;
-            n6 = ii.array[j+1][i-1]==val ? 1 : 0;
-            n7 = ii.array[j+1][i  ]==val ? 1 : 0;
-            n8 = ii.array[j+1][i+1]==val ? 1 : 0;
+// Edge nodes of every layer in the tile of nodes (x0, y0) - (x1-1, y1-1)
+static void layerTile(const Grid<uint8_t>& array, const std::vector<ColorBox>& boxes,
+                      int x0, int y0, int x1, int y1, std::vector<TileNodes>& tile) {
+    int colorCount = (int)boxes.size();
 
-            // this pixel"s type and looking back on previous pixels
-            layers[val][j+1][i+1] = 1 + (n5 * 2) + (n8 * 4) + (n7 * 8) ;
-            if(n4==0){ layers[val][j+1][i  ] = 0 + 2 + (n7 * 4) + (n6 * 8) ; }
-            if(n2==0){ layers[val][j  ][i+1] = 0 + (n3*2) + (n5 * 4) + 8 ; }
-            if(n1==0){ layers[val][j  ][i  ] = 0 + (n2*2) + 4 + (n4 * 8) ; }
+    if (colorCount <= vectorLayeringMaxColors) {
+        NodeRowKernel kernel = nodeRowKernel();
+        std::vector<uint8_t> packed((x1 - x0 + 1) / 2);
+        for (int j = y0; j < y1; j++) {
+            for (int c = 0; c < colorCount; c++) {
+                // Nodes of color c are in (box.x0, box.y0) - (box.x1+1, box.y1+1)
+                const ColorBox& box = boxes[c];
+                if (!box.empty() && j >= box.y0 && j <= box.y1 + 1 && x1 > box.x0 && x0 <= box.x1 + 1) {
+                    kernel(array[j-1] + x0 - 1, array[j] + x0 - 1, packed.data(), x1 - x0, (uint8_t)c);
+                    appendEdgeNodes(packed.data(), x0, x1 - x0, tile[c]);
+                }
+                tile[c].rowEnd.push_back((int)tile[c].xs.size());
+            }
+        }
+        return;
+    }
 
+    int tl, tr, br, bl, type;
+    for (int j = y0; j < y1; j++) {
+        const uint8_t* up = array[j-1];
+        const uint8_t* down = array[j];
+        for (int i = x0; i < x1; i++) {
+            tl = up[i-1]; tr = up[i]; br = down[i]; bl = down[i-1];
+            if (tl == tr && tl == br && tl == bl) {
+                continue;
+            }
+            // Same as layerRows, but only edge nodes are stored
+            if(tl!=boundaryIndex){ type = 1 + (tr==tl ? 2 : 0) + (br==tl ? 4 : 0) + (bl==tl ? 8 : 0);
+                if(type!=15){ tile[tl].xs.push_back(i); tile[tl].types.push_back(type); } }
+            if(tr!=boundaryIndex && tr!=tl){ type = 2 + (br==tr ? 4 : 0) + (bl==tr ? 8 : 0);
+                tile[tr].xs.push_back(i); tile[tr].types.push_back(type); }
+            if(br!=boundaryIndex && br!=tl && br!=tr){ type = 4 + (bl==br ? 8 : 0);
+                tile[br].xs.push_back(i); tile[br].types.push_back(type); }
+            if(bl!=boundaryIndex && bl!=tl && bl!=tr && bl!=br){
+                tile[bl].xs.push_back(i); tile[bl].types.push_back(8); }
+        }
+        for (int c = 0; c < colorCount; c++) {
+            tile[c].rowEnd.push_back((int)tile[c].xs.size());
         }
     }
+}
+
+std::vector<SparseNodeGrid> ImageTracer::tiledLayering(const IndexedImage& ii) {
+    int aw = ii.width, ah = ii.height, tileSize = options.tileSize;
+    int threads = workerCount();
+    std::vector<ColorBox> boxes = colorBoxes(ii.array, ii.colorCount, threads);
+
+    // Node row 0 and column 0 are outside the image and have no edges
+    std::vector<SparseNodeGrid> layers(ii.colorCount);
+    for (auto& layer : layers) {
+        layer.endRow();
+    }
+
+    int tileColumns = (aw - 1 + tileSize - 1) / tileSize;
+    for (int y0 = 1; y0 < ah; y0 += tileSize) {
+        int y1 = std::min(y0 + tileSize, ah);
+
+        std::vector<std::vector<TileNodes>> tiles(tileColumns, std::vector<TileNodes>(ii.colorCount));
+        parallelFor(tileColumns, threads, [&](int t) {
+            int x0 = 1 + t * tileSize;
+            layerTile(ii.array, boxes, x0, y0, std::min(x0 + tileSize, aw), y1, tiles[t]);
+        });
+
+        // Appending the rows of the tiles from left to right
+        parallelFor(ii.colorCount, threads, [&](int c) {
+            SparseNodeGrid& layer = layers[c];
+            for (int j = 0; j < y1 - y0; j++) {
+                for (int t = 0; t < tileColumns; t++) {
+                    const TileNodes& tile = tiles[t][c];
+                    for (int k = (j == 0 ? 0 : tile.rowEnd[j-1]); k < tile.rowEnd[j]; k++) {
+                        layer.push(tile.xs[k], tile.types[k]);
+                    }
+                }
+                layer.endRow();
+            }
+        });
+    }
 
     return layers;
 }
 
+// 1.+2. Streaming: rows are quantized as they are pushed and every node row is computed from a
+// window of the previous and the current palette index row, then appended to sparse layers as in
+// the tiled layering. Only the window and the edge nodes are stored.
+struct ImageTracer::RowStream {
+    IndexedImage ii; // palette and padded size, the array stays empty
+    Grid<uint8_t> window; // padded palette index rows, 0: previous, 1: current
+    std::vector<ColorBox> boxes; // every color may be anywhere in the window
+    std::vector<TileNodes> nodeRow;
+    std::vector<SparseNodeGrid> layers;
+    int rows = 0;
+};
+
+// Appends the node row between the two window rows to the layers
+static void appendNodeRow(Grid<uint8_t>& window, const std::vector<ColorBox>& boxes,
+                          std::vector<TileNodes>& nodeRow, std::vector<SparseNodeGrid>& layers) {
+    for (TileNodes& nodes : nodeRow) {
+        nodes.xs.clear(); nodes.types.clear(); nodes.rowEnd.clear();
+    }
+    layerTile(window, boxes, 1, 1, window.width(), 2, nodeRow);
+    for (int c = 0; c < layers.size(); c++) {
+        for (int k = 0; k < nodeRow[c].xs.size(); k++) {
+            layers[c].push(nodeRow[c].xs[k], nodeRow[c].types[k]);
+        }
+        layers[c].endRow();
+    }
+}
+
+bool ImageTracer::beginImage(int width, int height) {
+    std::vector<Color> palette;
+    if (width <= 0 || height <= 0 || !quantizer->fixedPalette(palette) || palette.empty() || palette.size() > 255) {
+        stream.reset();
+        return false;
+    }
+
+    stream = std::make_shared<RowStream>();
+    RowStream& s = *stream;
+    int aw = width + 2, colorCount = (int)palette.size();
+    s.ii.width = aw;
+    s.ii.height = height + 2;
+    s.ii.colorCount = colorCount;
+    s.ii.palette = std::move(palette);
+    // Row 1 is the boundary above the image until the first row is pushed
+    s.window = Grid<uint8_t>(aw, 2, boundaryIndex);
+    s.boxes.resize(colorCount);
+    for (ColorBox& box : s.boxes) {
+        box.add(0, aw - 1, 0);
+        box.add(0, aw - 1, 1);
+    }
+    s.nodeRow.resize(colorCount);
+    // Node row 0 is outside the image
+    s.layers.resize(colorCount);
+    for (auto& layer : s.layers) {
+        layer.endRow();
+    }
+
+    printf("ImageTracer - Streaming rows\n");
+    return true;
+}
+
+void ImageTracer::pushRow(const uint8_t* rgb) {
+    if (!stream || stream->rows >= stream->ii.height - 2) {
+        return;
+    }
+    RowStream& s = *stream;
+    int aw = s.window.width();
+    memcpy(s.window[0], s.window[1], aw);
+    quantizer->quantizeRow(rgb, aw - 2, s.ii.palette, s.window[1] + 1);
+    s.rows++;
+    appendNodeRow(s.window, s.boxes, s.nodeRow, s.layers);
+}
+
+std::stringstream ImageTracer::finishImage() {
+    StringSink sink;
+    finishImage(sink);
+    return std::stringstream(sink.str());
+}
+
+bool ImageTracer::finishImage(OutputSink& sink) {
+    SvgExporter svg(sink);
+    return finishImage({ &svg });
+}
+
+bool ImageTracer::finishImage(const std::vector<Exporter*>& exporters) {
+    if (!stream) {
+        return false;
+    }
+    std::shared_ptr<RowStream> finished = stream;
+    stream.reset();
+    RowStream& s = *finished;
+
+    // The boundary below the last pushed row closes the layers
+    int aw = s.window.width();
+    memcpy(s.window[0], s.window[1], aw);
+    memset(s.window[1], boundaryIndex, aw);
+    appendNodeRow(s.window, s.boxes, s.nodeRow, s.layers);
+    s.ii.height = s.rows + 2;
+
+    threeDim<Internode> binternodes = scanPaths(std::move(s.layers));
+    return traceAndExport(s.ii, std::move(binternodes), exporters);
+}
+
 // Lookup tables for pathscan
 int pathscan_dir_lookup[16] = { 0,0,3,0, 1,0,3,0, 0,3,3,1, 0,3,0,0 };
 bool pathscan_holepath_lookup[16] = { false,false,false,false, false,false,false,true, false,false,false,true, false,true,true,false };
@@ -153,138 +558,298 @@ int pathscan_combined_lookup[16][4][4]  = {
 // ░░  ░░  ░░  ░░  ░▓  ░▓  ░▓  ░▓  ▓░  ▓░  ▓░  ▓░  ▓▓  ▓▓  ▓▓  ▓▓
 // 0   1   2   3   4   5   6   7   8   9   10  11  12  13  14  15
 //
-fourDim<int> ImageTracer::batchPathScan(threeDim<int> layers) {
-    
-    fourDim<int> pathscans;
-
-    for (auto& arr : layers) {
-        threeDim<int> paths;
-        twoDim<int> thisPath;
-        int px = 0, py = 0, w = arr[0].size(), h = arr.size(), dir = 0;
-        bool pathfinished = true, holepath = false;
-        int* lookuprow = pathscan_combined_lookup[0][0];
-        float pathomit = 1.0f;
-        
-        for(int j=0;j<h;j++){
-            for(int i=0;i<w;i++){
-                if((arr[j][i]!=0)&&(arr[j][i]!=15)){
-
-                    // Init
-                    px = i; py = j;
-                    //printf("py: %d ", py);
-                    //printf("j: %d \n", j);
-                    thisPath = twoDim<int>();
-                    pathfinished = false;
-
-                    // fill paths will be drawn, but hole paths are also required to remove unnecessary edge nodes
-                    dir = pathscan_dir_lookup[ arr[py][px] ]; holepath = pathscan_holepath_lookup[ arr[py][px] ];
-
-                    // Path points loop
-                    while(!pathfinished) { // && px >= 0 && py >= 0 && px < w && py < h && arr[py][px] != 0 && arr[py][px] != 15){
-                
-                        int type = arr[py][px];
-                        // New path point
-                        auto point = std::vector<int>(3);
-                        point[0] = px-1;
-                        point[1] = py-1;
-                        point[2] = type;
-                        thisPath.push_back(point);
-
-                        // Next: look up the replacement, direction and coordinate changes = clear this cell, turn if required, walk forward
-                        lookuprow = pathscan_combined_lookup[ type ][ dir ];
-                        arr[py][px] = lookuprow[0]; dir = lookuprow[1]; px += lookuprow[2]; py += lookuprow[3];
-
-                        // Close path
-                        if(((px-1)==thisPath[0][0])&&((py-1)==thisPath[0][1])){
-                            pathfinished = true;
-                            // Discarding 'hole' type paths and paths shorter than pathomit
-                            if( (holepath) || (thisPath.size() < pathomit) ){
-                                // Do nothing
-                                //paths.erase(thispath);
-                            } else {
-                                paths.push_back(thisPath);
-                            }
-                        }
+// Rough edge node count of a layer from every 8th row, used for scheduling
+static long estimateEdgeNodes(const NodeGrid& arr) {
+    long count = 0;
+    for (int j = 0; j < arr.height(); j += 8) {
+        for (int i = 0; i < arr.width(); i++) {
+            uint8_t type = arr.get(i, j);
+            count += (type != 0) && (type != 15);
+        }
+    }
+    return count;
+}
 
-                    }
-                }
+static long estimateEdgeNodes(const SparseNodeGrid& arr) {
+    return arr.size();
+}
+
+// Walks the path starting at the edge node (i, j) and hands its points to the collector:
+// begin() before the first point, add(point) for every point and end(keep) when the path is closed.
+// keep is false for hole paths and for paths omitted by pathomit or minPathArea.
+// Nodes is a NodeGrid or a SparseNodeGrid, visited edge nodes are cleared.
+template <class Nodes, class Collector>
+static void walkPath(Nodes& arr, int i, int j, const TracerOptions& options, TraceStats& layerStats, Collector& collector) {
+    PathPoint first = {0, 0, 0}, last = {0, 0, 0};
+    long count = 0;
+    int px = i, py = j, dir = 0;
+    // Grid node (px, py) is the path point (px + ox, py + oy)
+    int ox = arr.left() - 1, oy = arr.top() - 1;
+    bool pathfinished = false, holepath = false;
+    int* lookuprow = pathscan_combined_lookup[0][0];
+    float pathomit = options.pathomit;
+    // Twice the enclosed area, summed up with the shoelace formula while walking
+    int64_t area2 = 0;
+    double minArea2 = 2.0 * options.minPathArea;
+
+    collector.begin();
+
+    // fill paths will be drawn, but hole paths are also required to remove unnecessary edge nodes
+    dir = pathscan_dir_lookup[ arr.get(px, py) ]; holepath = pathscan_holepath_lookup[ arr.get(px, py) ];
+
+    // Path points loop
+    while(!pathfinished) {
+
+        int type = arr.get(px, py);
+        // New path point
+        PathPoint point = { px+ox, py+oy, (uint8_t)type };
+        if (count == 0) {
+            first = point;
+        } else {
+            area2 += (int64_t)last.x * point.y - (int64_t)point.x * last.y;
+        }
+        collector.add(point);
+        last = point;
+        count++;
+
+        // Next: look up the replacement, direction and coordinate changes = clear this cell, turn if required, walk forward
+        lookuprow = pathscan_combined_lookup[ type ][ dir ];
+        arr.set(px, py, lookuprow[0]); dir = lookuprow[1]; px += lookuprow[2]; py += lookuprow[3];
+
+        // Close path
+        if(((px+ox)==first.x)&&((py+oy)==first.y)){
+            pathfinished = true;
+            area2 += (int64_t)last.x * first.y - (int64_t)first.x * last.y;
+            // Discarding 'hole' type paths, paths shorter than pathomit and paths smaller than minPathArea
+            bool keep = false;
+            if (holepath) {
+                // Do nothing
+            } else if (count < pathomit) {
+                layerStats.pathsScanned++;
+                layerStats.pathsOmittedByLength++;
+            } else if (std::abs((double)area2) < minArea2) {
+                layerStats.pathsScanned++;
+                layerStats.pathsOmittedByArea++;
+            } else {
+                layerStats.pathsScanned++;
+                keep = true;
             }
+            collector.end(keep);
         }
-        pathscans.push_back(paths);
+
     }
-    
+}
+
+// Walks every path of a layer, starting them in raster order
+template <class Collector>
+static void scanLayer(NodeGrid& arr, const TracerOptions& options, TraceStats& layerStats, Collector& collector) {
+    int w = arr.width(), h = arr.height();
+    for(int j=0;j<h;j++){
+        for(int i=0;i<w;i++){
+            // Skipping two nodes at once where there is no edge
+            if(((i&1)==0)&&!hasEdgeNode(arr[j][i>>1])){ i++; continue; }
+            if((arr.get(i, j)!=0)&&(arr.get(i, j)!=15)){
+                walkPath(arr, i, j, options, layerStats, collector);
+            }
+        }
+    }
+}
+
+// Same raster order as the dense grid, nodes missing from the sparse grid are 0 or 15
+template <class Collector>
+static void scanLayer(SparseNodeGrid& arr, const TracerOptions& options, TraceStats& layerStats, Collector& collector) {
+    for(int j=0;j<arr.height();j++){
+        for(int k=arr.rowBegin(j);k<arr.rowEnd(j);k++){
+            // Types are read again after every walk, as walks clear the nodes they visit
+            if(arr.typeAt(k)!=0){
+                walkPath(arr, arr.xAt(k), j, options, layerStats, collector);
+            }
+        }
+    }
+}
+
+// Scans the layers in parallel, the paths of layer k are collected into out[k] by a Collector(out[k])
+template <class Collector, class Layer>
+static void scanLayers(std::vector<Layer>& layers, const TracerOptions& options, int threads,
+                       threeDim<typename Collector::Point>& out, TraceStats& stats) {
+    out.resize(layers.size());
+    // Layers are scanned independently into their own slot, so path order is stable
+    std::vector<int> order(layers.size());
+    for (int k = 0; k < layers.size(); k++) {
+        order[k] = k;
+    }
+
+    if (threads > 1 && (int)layers.size() > threads) {
+        // Start with the layers with the most edges, so a busy layer doesn't finish last
+        std::vector<long> estimates(layers.size());
+        parallelFor((int)layers.size(), threads, [&](int k) {
+            estimates[k] = estimateEdgeNodes(layers[k]);
+        });
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+            return estimates[a] > estimates[b];
+        });
+    }
+
+    std::vector<TraceStats> layerStats(layers.size());
+    parallelFor((int)layers.size(), threads, [&](int j) {
+        int k = order[j];
+        Collector collector(out[k]);
+        scanLayer(layers[k], options, layerStats[k], collector);
+    });
+
+    stats = TraceStats();
+    for (const TraceStats& layer : layerStats) {
+        stats.pathsScanned += layer.pathsScanned;
+        stats.pathsOmittedByLength += layer.pathsOmittedByLength;
+        stats.pathsOmittedByArea += layer.pathsOmittedByArea;
+    }
+}
+
+// Stores the path points of the kept paths
+class PathPointCollector {
+public:
+    typedef PathPoint Point;
+
+    explicit PathPointCollector(twoDim<PathPoint>& paths) : paths(paths) {}
+
+    void begin() { thisPath.clear(); }
+    void add(const PathPoint& point) { thisPath.push_back(point); }
+    void end(bool keep) {
+        if (keep) {
+            paths.push_back(thisPath);
+        }
+    }
+
+private:
+    twoDim<PathPoint>& paths;
+    std::vector<PathPoint> thisPath;
+};
+
+template <class Layer>
+threeDim<PathPoint> ImageTracer::batchPathScan(std::vector<Layer> layers) {
+    threeDim<PathPoint> pathscans;
+    scanLayers<PathPointCollector>(layers, options, workerCount(), pathscans, stats);
     return pathscans;
 }
 
 // 4. interpolating between path points for nodes with 8 directions ( East, SouthEast, S, SW, W, NW, N, NE )
-fourDim<double> ImageTracer::batchInternodes(fourDim<int> bPaths) {
-    fourDim<double> binternodes;
-
-    for (auto& paths : bPaths) {
-        threeDim<double> ins;
-        twoDim<double> thisinp;
-        std::vector<double> thisPoint = std::vector<double>(2);
-        std::vector<double> nextPoint = std::vector<double>(2);
-        std::vector<int> pp1, pp2, pp3;
+static Internode interpolate(const PathPoint& pp1, const PathPoint& pp2, const PathPoint& pp3) {
+    Internode thisPoint, nextPoint;
+    thisPoint.x = (pp1.x + pp2.x) / 2.0f;
+    thisPoint.y = (pp1.y + pp2.y) / 2.0f;
+    nextPoint.x = (pp2.x + pp3.x) / 2.0f;
+    nextPoint.y = (pp2.y + pp3.y) / 2.0f;
+    // line segment direction to the next point
+    if (thisPoint.x < nextPoint.x) {
+        if (thisPoint.y < nextPoint.y) {
+            thisPoint.dir = 1;
+        } // SouthEast
+        else if (thisPoint.y > nextPoint.y) {
+            thisPoint.dir = 7;
+        } // NE
+        else {
+            thisPoint.dir = 0;
+        } // E
+    } else if (thisPoint.x > nextPoint.x) {
+        if (thisPoint.y < nextPoint.y) {
+            thisPoint.dir = 3;
+        } // SW
+        else if (thisPoint.y > nextPoint.y) {
+            thisPoint.dir = 5;
+        } // NW
+        else {
+            thisPoint.dir = 4;
+        } // W
+    } else {
+        if (thisPoint.y < nextPoint.y) {
+            thisPoint.dir = 2;
+        } // S
+        else if (thisPoint.y > nextPoint.y) {
+            thisPoint.dir = 6;
+        } // N
+        else {
+            thisPoint.dir = 8;
+        } // center, this should not happen
+    }
+    return thisPoint;
+}
+
+threeDim<Internode> ImageTracer::batchInternodes(const threeDim<PathPoint>& bPaths) {
+    threeDim<Internode> binternodes;
+
+    for (const auto& paths : bPaths) {
+        twoDim<Internode> ins;
         int palen = 0, nextidx = 0, nextidx2 = 0;
         
         for (int pacnt = 0; pacnt < paths.size(); pacnt++) {
-            thisinp = twoDim<double>();
-            palen = paths[pacnt].size();
+            const std::vector<PathPoint>& path = paths[pacnt];
+            palen = path.size();
+            std::vector<Internode> thisinp(palen);
             
             // pathpoints loop
             for (int pcnt = 0; pcnt < palen; pcnt++) {
-
                 // interpolate between two path points
                 nextidx = (pcnt + 1) % palen;
                 nextidx2 = (pcnt + 2) % palen;
-                thisPoint = std::vector<double>(3);
-                pp1 = paths[pacnt][pcnt];
-                pp2 = paths[pacnt][nextidx];
-                pp3 = paths[pacnt][nextidx2];
-                thisPoint[0] = (pp1[0] + pp2[0]) / 2.0;
-                thisPoint[1] = (pp1[1] + pp2[1]) / 2.0;
-                nextPoint[0] = (pp2[0] + pp3[0]) / 2.0;
-                nextPoint[1] = (pp2[1] + pp3[1]) / 2.0;
-                // line segment direction to the next point
-                if (thisPoint[0] < nextPoint[0]) {
-                    if (thisPoint[1] < nextPoint[1]) {
-                        thisPoint[2] = 1.0;
-                    } // SouthEast
-                    else if (thisPoint[1] > nextPoint[1]) {
-                        thisPoint[2] = 7.0;
-                    } // NE
-                    else {
-                        thisPoint[2] = 0.0;
-                    } // E
-                } else if (thisPoint[0] > nextPoint[0]) {
-                    if (thisPoint[1] < nextPoint[1]) {
-                        thisPoint[2] = 3.0;
-                    } // SW
-                    else if (thisPoint[1] > nextPoint[1]) {
-                        thisPoint[2] = 5.0;
-                    } // NW
-                    else {
-                        thisPoint[2] = 4.0;
-                    } // W
-                } else {
-                    if (thisPoint[1] < nextPoint[1]) {
-                        thisPoint[2] = 2.0;
-                    } // S
-                    else if (thisPoint[1] > nextPoint[1]) {
-                        thisPoint[2] = 6.0;
-                    } // N
-                    else {
-                        thisPoint[2] = 8.0;
-                    } // center, this should not happen
-                }
-                thisinp.push_back(thisPoint);
+                thisinp[pcnt] = interpolate(path[pcnt], path[nextidx], path[nextidx2]);
             }
-            ins.push_back(thisinp);
+            ins.push_back(std::move(thisinp));
         }
         
-        binternodes.push_back(ins);
+        binternodes.push_back(std::move(ins));
+    }
+    return binternodes;
+}
+
+// 3.+4. Fused scan: internodes are interpolated while walking, path points are never stored.
+// Only the first two and the last two points of the current path are kept, the internodes of
+// the last two points wrap around to the first ones when the path is closed.
+class InternodeCollector {
+public:
+    typedef Internode Point;
+
+    explicit InternodeCollector(twoDim<Internode>& paths) : paths(paths) {}
+
+    void begin() {
+        thisPath.clear();
+        count = 0;
+    }
+    void add(const PathPoint& point) {
+        if (count == 0) {
+            first = point;
+        } else if (count == 1) {
+            second = point;
+        } else {
+            thisPath.push_back(interpolate(prev2, prev1, point));
+        }
+        prev2 = prev1;
+        prev1 = point;
+        count++;
+    }
+    void end(bool keep) {
+        if (!keep) {
+            return;
+        }
+        if (count == 1) {
+            thisPath.push_back(interpolate(first, first, first));
+        } else {
+            thisPath.push_back(interpolate(prev2, prev1, first));
+            thisPath.push_back(interpolate(prev1, first, second));
+        }
+        paths.push_back(thisPath);
     }
+
+private:
+    twoDim<Internode>& paths;
+    std::vector<Internode> thisPath;
+    PathPoint first, second, prev2, prev1;
+    long count = 0;
+};
+
+template <class Layer>
+threeDim<Internode> ImageTracer::batchPathScanInternodes(std::vector<Layer> layers) {
+    threeDim<Internode> binternodes;
+    scanLayers<InternodeCollector>(layers, options, workerCount(), binternodes, stats);
     return binternodes;
 }
 
@@ -298,86 +863,86 @@ fourDim<double> ImageTracer::batchInternodes(fourDim<int> bPaths) {
 // errors on every point in the sequence
 // 5.5. If the spline fails (an error>qtreshold), find the point with the biggest error, set
 // splitpoint = (fitting point + errorpoint)/2
-// 5.6. Split sequence and recursively apply 5.2. - 5.7. to startpoint-splitpoint and
-// splitpoint-endpoint sequences
+// 5.6. Split sequence and apply 5.2. - 5.7. to startpoint-splitpoint and
+// splitpoint-endpoint sequences, using a work stack instead of recursion
 // 5.7. TODO? If splitpoint-endpoint is a spline, try to add new points from the next sequence
 
-// This returns an SVG Path segment as a double[7] where
-// segment[0] ==1.0 linear  ==2.0 quadratic interpolation
-// segment[1] , segment[2] : x1 , y1
-// segment[3] , segment[4] : x2 , y2 ; middle point of Q curve, endpoint of L line
-// segment[5] , segment[6] : x3 , y3 for Q curve, should be 0.0 , 0.0 for L line
+// This returns SVG Path segments, see Segment for the layout
 //
 // path type is discarded, no check for path.size < 3 , which should not happen
-fourDim<double> ImageTracer::batchTraceLayers(fourDim<double> binternodes, float ltreshold, float qtreshold) {
-    fourDim<double> btbis;
+threeDim<Segment> ImageTracer::batchTraceLayers(const threeDim<Internode>& binternodes, float ltreshold, float qtreshold) {
+    threeDim<Segment> btbis(binternodes.size());
+    // Every path is traced independently into its own slot, so the result doesn't depend on
+    // the thread count. Longest paths go first, so a huge outline doesn't finish last.
+    std::vector<std::pair<int, int>> jobs; // layer index, path index
     
-    for (auto& internodepaths : binternodes) {
-        threeDim<double> btracedpaths;
-
-        for (auto& path : internodepaths) {
-            int pcnt = 0, seqend = 0;
-            double segtype1, segtype2;
-            twoDim<double> smp;
-            
-            // Double [] thissegment;
-            int pathlength = path.size();
-
-            while (pcnt < pathlength) {
-              // 5.1. Find sequences of points with only 2 segment types
-              segtype1 = path[pcnt][2];
-              segtype2 = -1;
-              seqend = pcnt + 1;
-              while (((path[seqend][2] == segtype1)
-                      || (path[seqend][2] == segtype2)
-                      || (segtype2 == -1))
-                  && (seqend < (pathlength - 1))) {
-                if ((path[seqend][2] != segtype1) && (segtype2 == -1)) {
-                  segtype2 = path[seqend][2];
-                }
-                seqend++;
-              }
-              if (seqend == (pathlength - 1)) {
-                seqend = 0;
-              }
-
-              // 5.2. - 5.6. Split sequence and recursively apply 5.2. - 5.6. to startpoint-splitpoint and
-              // splitpoint-endpoint sequences
-              auto segment = fitseq(path, ltreshold, qtreshold, pcnt, seqend);
-              for (auto& thissegment : segment) {
-                  smp.push_back(thissegment);
-              }
-                
-              // 5.7. TODO? If splitpoint-endpoint is a spline, try to add new points from the next sequence
-
-              // forward pcnt;
-              if (seqend > 0) {
-                pcnt = seqend;
-              } else {
-                pcnt = pathlength;
-              }
-            } // End of pcnt loop
-
-            btracedpaths.push_back(smp);
+    for (int k = 0; k < binternodes.size(); k++) {
+        btbis[k].resize(binternodes[k].size());
+        for (int pacnt = 0; pacnt < binternodes[k].size(); pacnt++) {
+            jobs.push_back(std::make_pair(k, pacnt));
         }
-        
-        btbis.push_back(btracedpaths);
     }
     
+    int threads = workerCount();
+    if (threads > 1) {
+        std::stable_sort(jobs.begin(), jobs.end(), [&](const std::pair<int, int>& a, const std::pair<int, int>& b) {
+            return binternodes[a.first][a.second].size() > binternodes[b.first][b.second].size();
+        });
+    }
+    
+    parallelFor((int)jobs.size(), threads, [&](int j) {
+        int k = jobs[j].first, pacnt = jobs[j].second;
+        tracePath(binternodes[k][pacnt], ltreshold, qtreshold, btbis[k][pacnt]);
+    });
+    
     return btbis;
 }
 
-twoDim<double> ImageTracer::fitseq(twoDim<double> path, float ltreshold, float qtreshold, int seqstart, int seqend) {
-    twoDim<double> segment;
-    std::vector<double> thisSegment;
+void ImageTracer::tracePath(Span<Internode> path, float ltreshold, float qtreshold, std::vector<Segment>& segments) {
+    int pcnt = 0, seqend = 0;
+    int segtype1, segtype2;
+    
+    // Double [] thissegment;
     int pathlength = path.size();
 
-    
-    // return if invalid seqend
-    if ((seqend > pathlength) || (seqend < 0)) {
-      return segment;
-    }
+    while (pcnt < pathlength) {
+      // 5.1. Find sequences of points with only 2 segment types
+      segtype1 = path[pcnt].dir;
+      segtype2 = -1;
+      seqend = pcnt + 1;
+      while (((path[seqend].dir == segtype1)
+              || (path[seqend].dir == segtype2)
+              || (segtype2 == -1))
+          && (seqend < (pathlength - 1))) {
+        if ((path[seqend].dir != segtype1) && (segtype2 == -1)) {
+          segtype2 = path[seqend].dir;
+        }
+        seqend++;
+      }
+      if (seqend == (pathlength - 1)) {
+        seqend = 0;
+      }
 
+      // 5.2. - 5.6. Split sequence and apply 5.2. - 5.6. to startpoint-splitpoint and
+      // splitpoint-endpoint sequences
+      fitseq(path, ltreshold, qtreshold, pcnt, seqend, segments);
+        
+      // 5.7. TODO? If splitpoint-endpoint is a spline, try to add new points from the next sequence
+
+      // forward pcnt;
+      if (seqend > 0) {
+        pcnt = seqend;
+      } else {
+        pcnt = pathlength;
+      }
+    } // End of pcnt loop
+}
+
+// Fits a straight line or a quadratic spline on the path[seqstart] - path[seqend] sequence.
+// Appends the segment and returns true if one fits, otherwise returns false and sets the
+// point where the sequence should be split.
+static bool fitSegment(Span<Internode> path, float ltreshold, float qtreshold, int seqstart, int seqend, std::vector<Segment>& segments, int& splitpoint) {
+    int pathlength = path.size();
     int errorpoint = seqstart;
     bool curvepass = true;
     double px, py, dist2, errorval = 0;
@@ -385,8 +950,8 @@ twoDim<double> ImageTracer::fitseq(twoDim<double> path, float ltreshold, float q
     if (tl < 0) {
       tl += pathlength;
     }
-    double vx = (path[seqend][0] - path[seqstart][0]) / tl,
-        vy = (path[seqend][1] - path[seqstart][1]) / tl;
+    double vx = (path[seqend].x - path[seqstart].x) / tl,
+        vy = (path[seqend].y - path[seqstart].y) / tl;
 
     // 5.2. Fit a straight line on the sequence
     int pcnt = (seqstart + 1) % pathlength;
@@ -396,11 +961,11 @@ twoDim<double> ImageTracer::fitseq(twoDim<double> path, float ltreshold, float q
       if (pl < 0) {
         pl += pathlength;
       }
-      px = path[seqstart][0] + (vx * pl);
-      py = path[seqstart][1] + (vy * pl);
+      px = path[seqstart].x + (vx * pl);
+      py = path[seqstart].y + (vy * pl);
       dist2 =
-          ((path[pcnt][0] - px) * (path[pcnt][0] - px))
-              + ((path[pcnt][1] - py) * (path[pcnt][1] - py));
+          ((path[pcnt].x - px) * (path[pcnt].x - px))
+              + ((path[pcnt].y - py) * (path[pcnt].y - py));
       if (dist2 > ltreshold) {
         curvepass = false;
       }
@@ -413,16 +978,11 @@ twoDim<double> ImageTracer::fitseq(twoDim<double> path, float ltreshold, float q
 
     // return straight line if fits
     if (curvepass) {
-        thisSegment = std::vector<double>(7);
-        thisSegment[0] = 1.0;
-        thisSegment[1] = path[seqstart][0];
-        thisSegment[2] = path[seqstart][1];
-        thisSegment[3] = path[seqend][0];
-        thisSegment[4] = path[seqend][1];
-        thisSegment[5] = 0.0;
-        thisSegment[6] = 0.0;
-        segment.push_back(thisSegment);
-      return segment;
+        segments.push_back({ SegmentType::Line,
+            path[seqstart].x, path[seqstart].y,
+            path[seqend].x, path[seqend].y,
+            0.0f, 0.0f });
+      return true;
     }
 
     // 5.3. If the straight line fails (an error>ltreshold), find the point with the biggest error
@@ -438,10 +998,10 @@ twoDim<double> ImageTracer::fitseq(twoDim<double> path, float ltreshold, float q
         t3 = t * t;
     double
         cpx =
-            (((t1 * path[seqstart][0]) + (t3 * path[seqend][0])) - path[fitpoint][0])
+            (((t1 * path[seqstart].x) + (t3 * path[seqend].x)) - path[fitpoint].x)
                 / -t2,
         cpy =
-            (((t1 * path[seqstart][1]) + (t3 * path[seqend][1])) - path[fitpoint][1])
+            (((t1 * path[seqstart].y) + (t3 * path[seqend].y)) - path[fitpoint].y)
                 / -t2;
 
     // Check every point
@@ -452,12 +1012,12 @@ twoDim<double> ImageTracer::fitseq(twoDim<double> path, float ltreshold, float q
       t1 = (1.0 - t) * (1.0 - t);
       t2 = 2.0 * (1.0 - t) * t;
       t3 = t * t;
-      px = (t1 * path[seqstart][0]) + (t2 * cpx) + (t3 * path[seqend][0]);
-      py = (t1 * path[seqstart][1]) + (t2 * cpy) + (t3 * path[seqend][1]);
+      px = (t1 * path[seqstart].x) + (t2 * cpx) + (t3 * path[seqend].x);
+      py = (t1 * path[seqstart].y) + (t2 * cpy) + (t3 * path[seqend].y);
 
       dist2 =
-          ((path[pcnt][0] - px) * (path[pcnt][0] - px))
-              + ((path[pcnt][1] - py) * (path[pcnt][1] - py));
+          ((path[pcnt].x - px) * (path[pcnt].x - px))
+              + ((path[pcnt].y - py) * (path[pcnt].y - py));
 
       if (dist2 > qtreshold) {
         curvepass = false;
@@ -471,173 +1031,108 @@ twoDim<double> ImageTracer::fitseq(twoDim<double> path, float ltreshold, float q
 
     // return spline if fits
     if (curvepass) {
-        thisSegment = std::vector<double>(7);
-        thisSegment[0] = 2.0;
-        thisSegment[1] = path[seqstart][0];
-        thisSegment[2] = path[seqstart][1];
-        thisSegment[3] = cpx;
-        thisSegment[4] = cpy;
-        thisSegment[5] = path[seqend][0];
-        thisSegment[6] = path[seqend][1];
-        segment.push_back(thisSegment);
-      return segment;
+        segments.push_back({ SegmentType::Quad,
+            path[seqstart].x, path[seqstart].y,
+            (float)cpx, (float)cpy,
+            path[seqend].x, path[seqend].y });
+      return true;
     }
 
     // 5.5. If the spline fails (an error>qtreshold), find the point with the biggest error,
     // set splitpoint = (fitting point + errorpoint)/2
-    int splitpoint = (fitpoint + errorpoint) / 2;
+    splitpoint = (fitpoint + errorpoint) / 2;
+    return false;
+}
+
+void ImageTracer::fitseq(Span<Internode> path, float ltreshold, float qtreshold, int seqstart, int seqend, std::vector<Segment>& segments) {
+    int pathlength = path.size();
+    int splitpoint = 0;
+    // Sequences waiting to be fitted, the last one is fitted next
+    std::vector<std::pair<int, int>> pending;
+
+    while (true) {
+        // skip invalid seqend
+        if ((seqend <= pathlength) && (seqend >= 0)
+            && !fitSegment(path, ltreshold, qtreshold, seqstart, seqend, segments, splitpoint)) {
+            // 5.6. Split sequence, fit startpoint-splitpoint now and splitpoint-endpoint afterwards
+            pending.push_back(std::make_pair(splitpoint, seqend));
+            seqend = splitpoint;
+            continue;
+        }
 
-    // 5.6. Split sequence and recursively apply 5.2. - 5.6. to startpoint-splitpoint and
-    // splitpoint-endpoint sequences
-    segment = fitseq(path, ltreshold, qtreshold, seqstart, splitpoint);
-    auto splipointSegment = fitseq(path, ltreshold, qtreshold, splitpoint, seqend);
-    for (auto& thissegment : segment) {
-        segment.push_back(thissegment);
+        if (pending.empty()) {
+            break;
+        }
+        seqstart = pending.back().first;
+        seqend = pending.back().second;
+        pending.pop_back();
     }
+}
+
+// 6. Z-order: paths are drawn in the order of their start point, linearized as y * width + x.
+// Paths with the same start point are all kept, in layer and path order.
 
-    return segment;
+// Sort key of a double with the same order as the value
+static uint64_t orderedBits(double value) {
+    value += 0.0; // -0 becomes 0
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return (bits & 0x8000000000000000ull) ? ~bits : (bits | 0x8000000000000000ull);
 }
 
-bool mapContainsKey(std::map<double, std::vector<int>>& map, double key)
-{
-  if (map.find(key) == map.end()) return false;
-  return true;
-}
-
-std::map<double, std::vector<int>> createZIndex(IndexedImage ii) {
-    std::map<double, std::vector<int>> zindex;
-    float scale = 1.0;
-    int w = (int) (ii.width * scale);
-    double label;
-    // Layer loop
-    for (int k = 0; k < ii.layers.size(); k++) {
-      // Path loop
-      for (int pcnt = 0; pcnt < ii.layers[k].size(); pcnt++) {
-        // Label (Z-index key) is the startpoint of the path, linearized
-        label = (ii.layers[k][pcnt][0][2] * w) + ii.layers[k][pcnt][0][1];
-        // Creating new list if required
-          if(!mapContainsKey(zindex, label)) {
-              zindex[label] = std::vector<int>(2);
-          }
-          // Adding layer and path number to list
-          zindex[label][0] = k;
-          zindex[label][1] = pcnt;
-      }
-    }
-    return zindex;
-}
-
-std::stringstream ImageTracer::toSvgStringStream(IndexedImage ii) {
-    float scale = 1.0;
-    // SVG start
-    int w = (int) (ii.width * scale), h = (int) (ii.height * scale);
-    std::stringstream ss;
-    ss << "<svg " << "width=\"" << w << "\" height=\"" << h << "\" ";
-    ss << "version=\"1.1\" xmlns=\"http://www.w3.org/2000/svg\">";
-
-    std::map<double, std::vector<int>> zindex = createZIndex(ii);
-
-    // Drawing
-    // Z-index loop
-    for (auto const& x : zindex) {
-        auto value = x.second;
-        twoDim<double> segments = ii.layers[value[0]][value[1]];
-        std::string colorstr = value[0] == 0 ?
-        "fill=\"rgb(255,255,255)\" stroke=\"rgb(0,0,0)\" opacity=\"1\" " :
-        "fill=\"rgb(0,0,0)\" stroke=\"rgb(255,255,255)\" opacity=\"1\" ";
-        // Path
-        ss << "<path " << colorstr << "d=\"" << "M " << (segments[0][1] * scale) << " " << segments[0][2] * scale << " ";
-
-          for (int pcnt = 0; pcnt < segments.size(); pcnt++) {
-            if (segments[pcnt][0] == 1.0) {
-                ss << "L ";
-                ss << (segments[pcnt][3] * scale);
-                ss << " ";
-                ss << (segments[pcnt][4] * scale);
-                ss << " ";
-            } else {
-                ss << "Q ";
-                ss << (segments[pcnt][3] * scale);
-                ss << " ";
-                ss << (segments[pcnt][4] * scale);
-                ss << " ";
-                ss << (segments[pcnt][5] * scale);
-                ss << " ";
-                ss << (segments[pcnt][6] * scale);
-                ss << " ";
-            }
-          }
-        
+struct ZOrderRecord {
+    uint64_t key;
+    PathRef ref;
+};
 
-        ss << "Z\" />";
+// Stable LSD radix sort on 8 bit digits, digits that are the same in every key are skipped
+static void radixSort(std::vector<ZOrderRecord>& records) {
+    std::vector<ZOrderRecord> scratch(records.size());
+    size_t counts[8][256] = {};
+    for (const ZOrderRecord& record : records) {
+        for (int digit = 0; digit < 8; digit++) {
+            counts[digit][(record.key >> (digit * 8)) & 255]++;
+        }
     }
 
-    // SVG End
-    ss << "</svg>";
-    
-    return ss;
+    for (int digit = 0; digit < 8; digit++) {
+        size_t* count = counts[digit];
+        if (count[(records[0].key >> (digit * 8)) & 255] == records.size()) {
+            continue;
+        }
+        size_t offset = 0;
+        for (int bucket = 0; bucket < 256; bucket++) {
+            size_t bucketSize = count[bucket];
+            count[bucket] = offset;
+            offset += bucketSize;
+        }
+        for (const ZOrderRecord& record : records) {
+            scratch[count[(record.key >> (digit * 8)) & 255]++] = record;
+        }
+        records.swap(scratch);
+    }
 }
 
-void ImageTracer::exportPDF(IndexedImage ii) {    
-    float scale = 1.0;
-    int w = (int) (ii.width * scale), h = (int) (ii.height * scale);
-    struct pdf_info info = { .creator = "", .producer = "",
-        .title = "", .author = "", .subject = "" };
-    struct pdf_doc *pdf = pdf_create(w, h, &info);
-    pdf_append_page(pdf);
-    
-    std::map<double, std::vector<int>> zindex = createZIndex(ii);
-    
-    for (auto const& x : zindex) {
-        auto value = x.second;
-        twoDim<double> segments = ii.layers[value[0]][value[1]];
-        
-        int operation_count = (int)segments.size() + 2;
-        struct pdf_path_operation *operations = (struct pdf_path_operation *)malloc(sizeof(struct pdf_path_operation) * operation_count);
-        float curr_x, prev_x = segments[0][1] * scale;
-        float curr_y, prev_y = segments[0][2] * scale;
-        
-        operations[0] = { .op = 'm', .x1 = prev_x, .y1 = h - prev_y };
-
-        for (int pcnt = 0; pcnt < segments.size(); pcnt++) {
-            if (segments[pcnt][0] == 1.0) {
-                curr_x = segments[pcnt][3] * scale;
-                curr_y = segments[pcnt][4] * scale;
-                operations[pcnt + 1] = { .op = 'l', .x1 = curr_x, .y1 = h - curr_y };
-            } else {
-                curr_x = segments[pcnt][5] * scale;
-                curr_y = segments[pcnt][6] * scale;
-                float xq1 = segments[pcnt][3] * scale;
-                float yq1 = segments[pcnt][4] * scale;
-                
-                float xc1 = prev_x + (xq1 - prev_x) * (2.0 / 3.0);
-                float yc1 = prev_y + (yq1 - prev_y) * (2.0 / 3.0);
-                float xc2 = curr_x + (xq1 - curr_x) * (2.0 / 3.0);
-                float yc2 = curr_y + (yq1 - curr_y) * (2.0 / 3.0);
-                
-                operations[pcnt + 1] = { .op = 'c', .x1 = xc1, .y1 = h - yc1,
-                    .x2 = xc2, .y2 = h - yc2, .x3 = curr_x, .y3 = h - curr_y
-                };
-            }
-            prev_x = curr_x;
-            prev_y = curr_y;
+void createZOrder(IndexedImage& ii) {
+    // Segment coordinates are in pixels, the output scale doesn't change the order
+    int w = ii.width;
+    std::vector<ZOrderRecord> records;
+    for (uint32_t k = 0; k < ii.layers.size(); k++) {
+        for (uint32_t pcnt = 0; pcnt < ii.layers[k].size(); pcnt++) {
+            const Segment& start = ii.layers[k][pcnt][0];
+            records.push_back({ orderedBits((double)start.y1 * w + start.x1), { k, pcnt } });
         }
-        
-        operations[operation_count - 1] = { .op = 'h' };
-        
-        uint32_t fill_color = value[0] == 0 ? PDF_RGB(0xff, 0xff, 0xff) : PDF_RGB(0, 0, 0);
-        uint32_t stroke_color = value[0] != 0 ? PDF_RGB(0xff, 0xff, 0xff) : PDF_RGB(0, 0, 0);
-        pdf_add_custom_path(pdf, NULL, operations, operation_count, 1, stroke_color, fill_color);
     }
-    
-    pdf_save(pdf, "./out/test.pdf");
-        
-    int err;
-    const char *err_str = pdf_get_err(pdf, &err);
-    if (err_str) {
-        fprintf(stderr, "PDF Error: %d - %s\n", err, err_str);
+
+    ii.zorder.clear();
+    if (records.empty()) {
+        return;
+    }
+    radixSort(records);
+    ii.zorder.reserve(records.size());
+    for (const ZOrderRecord& record : records) {
+        ii.zorder.push_back(record.ref);
     }
-    pdf_destroy(pdf);
 }
 
 }
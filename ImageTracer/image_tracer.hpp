@@ -10,10 +10,14 @@
 #define image_tracer_hpp
 
 #include <stdio.h>
+#include <stdint.h>
+#include <algorithm>
 #include <vector>
 #include <iostream>
 #include <sstream>
 #include <map>
+#include <memory>
+#include <string>
 
 namespace IMGTrace
 {
@@ -32,38 +36,283 @@ struct Pixel {
     unsigned int x, y;
 };
 
+// Single allocation 2D buffer, rows are padded to a multiple of 16 elements.
+// grid[y] returns a pointer to the start of row y, so grid[y][x] addresses a cell.
+template <typename T>
+class Grid {
+public:
+    Grid() {}
+    Grid(int width, int height, T value = T())
+        : w(width), h(height), s((width + 15) & ~15), buffer((size_t)s * height, value) {}
+
+    int width() const { return w; }
+    int height() const { return h; }
+    int stride() const { return s; }
+
+    T* data() { return buffer.data(); }
+    const T* data() const { return buffer.data(); }
+    T* operator[](int y) { return buffer.data() + (size_t)y * s; }
+    const T* operator[](int y) const { return buffer.data() + (size_t)y * s; }
+
+private:
+    int w = 0, h = 0, s = 0;
+    std::vector<T> buffer;
+};
+
+// Read-only view of a contiguous array
+template <typename T>
+class Span {
+public:
+    Span(const T* data, int size) : ptr(data), count(size) {}
+    Span(const std::vector<T>& v) : ptr(v.data()), count((int)v.size()) {}
+
+    int size() const { return count; }
+    const T& operator[](int i) const { return ptr[i]; }
+
+private:
+    const T* ptr;
+    int count;
+};
+
+// Edge node types (0-15) of a layer, packed two per byte: node x of a row is the low nibble
+// of byte x/2 if x is even and the high nibble otherwise.
+// The grid may cover only a part of the image, node (x, y) is the image node (left + x, top + y).
+class NodeGrid {
+public:
+    NodeGrid() {}
+    NodeGrid(int width, int height, int left = 0, int top = 0)
+        : w(width), l(left), t(top), bytes((width + 1) / 2, height) {}
+
+    int width() const { return w; }
+    int height() const { return bytes.height(); }
+    int left() const { return l; }
+    int top() const { return t; }
+    int rowBytes() const { return bytes.width(); }
+
+    uint8_t get(int x, int y) const { return (bytes[y][x >> 1] >> ((x & 1) << 2)) & 15; }
+    void set(int x, int y, uint8_t type) {
+        uint8_t& b = bytes[y][x >> 1];
+        int shift = (x & 1) << 2;
+        b = (uint8_t)((b & ~(15 << shift)) | ((type & 15) << shift));
+    }
+    // Packed row y
+    uint8_t* operator[](int y) { return bytes[y]; }
+    const uint8_t* operator[](int y) const { return bytes[y]; }
+
+private:
+    int w = 0, l = 0, t = 0;
+    Grid<uint8_t> bytes;
+};
+
+// Edge nodes (types 1-14) of a layer in raster order, every other node reads as 0.
+// Rows are appended with push() and endRow(), row y holds the nodes rowBegin(y) ... rowEnd(y)-1
+// sorted by x. set() only changes nodes that are stored.
+class SparseNodeGrid {
+public:
+    SparseNodeGrid() : rowStart(1, 0) {}
+
+    int height() const { return (int)rowStart.size() - 1; }
+    int left() const { return 0; }
+    int top() const { return 0; }
+    int size() const { return (int)xs.size(); }
+
+    void push(int x, uint8_t type) { xs.push_back(x); types.push_back(type); }
+    void endRow() { rowStart.push_back((int)xs.size()); }
+
+    int rowBegin(int y) const { return rowStart[y]; }
+    int rowEnd(int y) const { return rowStart[y + 1]; }
+    int xAt(int k) const { return xs[k]; }
+    uint8_t typeAt(int k) const { return types[k]; }
+
+    uint8_t get(int x, int y) const {
+        int k = find(x, y);
+        return k < 0 ? 0 : types[k];
+    }
+    void set(int x, int y, uint8_t type) {
+        int k = find(x, y);
+        if (k >= 0) {
+            types[k] = type;
+        }
+    }
+
+private:
+    std::vector<int> rowStart;
+    std::vector<int32_t> xs;
+    std::vector<uint8_t> types;
+
+    int find(int x, int y) const {
+        auto begin = xs.begin() + rowStart[y], end = xs.begin() + rowStart[y + 1];
+        auto it = std::lower_bound(begin, end, x);
+        return (it != end && *it == x) ? (int)(it - xs.begin()) : -1;
+    }
+};
+
 template <typename T>
 using twoDim = std::vector<std::vector<T>>;
 template <typename T>
 using threeDim = std::vector<std::vector<std::vector<T>>>;
-template <typename T>
-using fourDim = std::vector<std::vector<std::vector<std::vector<T>>>>;
+
+// Edge node visited by the path scan, type is the edge node type (0-15)
+struct PathPoint {
+    int32_t x, y;
+    uint8_t type;
+};
+
+// Point between two path points, dir is the direction to the next internode
+// ( 0:E, 1:SE, 2:S, 3:SW, 4:W, 5:NW, 6:N, 7:NE, 8:none )
+struct Internode {
+    float x, y;
+    uint8_t dir;
+};
+
+enum class SegmentType : uint8_t {
+    Line = 1,
+    Quad = 2
+};
+
+// Traced SVG path segment
+// x1, y1 : start point
+// x2, y2 : control point of Q curve, endpoint of L line
+// x3, y3 : endpoint of Q curve, 0 for L line
+struct Segment {
+    SegmentType type;
+    float x1, y1, x2, y2, x3, y3;
+};
+
+// Palette index of the boundary around the indexed image, palettes hold at most 255 colors
+const uint8_t boundaryIndex = 255;
+
+// Path layers[layer][path] of an IndexedImage
+struct PathRef {
+    uint32_t layer, path;
+};
 
 struct IndexedImage {
     int width, height, colorCount;
     std::vector<Color> palette;// array[palettelength][4] RGBA color palette
-    twoDim<int> array; // array[x][y] of palette colors
-    fourDim<double> layers;// tracedata
+    Grid<uint8_t> array; // array[y][x] of palette colors
+    threeDim<Segment> layers;// tracedata: layers[color][path][segment]
+    std::vector<PathRef> zorder; // every path of layers in drawing order
+};
+
+// Sorts the paths of ii.layers into ii.zorder by their start point
+void createZOrder(IndexedImage& ii);
+
+// Pixel value compared by ThresholdQuantizer, luminance is 0.3 R + 0.59 G + 0.11 B
+enum class ThresholdChannel {
+    Luminance,
+    Red,
+    Green,
+    Blue
+};
+
+enum class QuantizationMethod {
+    Threshold, // black and white, see threshold and thresholdChannel
+    MedianCut,
+    KMeans
+};
+
+struct TracerOptions {
+    // Tracing
+    float ltres = 10.0f; // error treshold for straight lines (squared distance)
+    float qtres = 10.0f; // error treshold for quadratic splines (squared distance)
+    float pathomit = 1.0f; // paths with fewer points are discarded
+    float minPathArea = 0.0f; // paths enclosing fewer pixels are discarded
+    int threadCount = 1; // 0 uses every hardware thread
+    // Sparse layers: node types are computed in tiles of this many nodes and only the edge nodes
+    // are stored, 0 keeps a dense grid per layer. This shrinks the layers, not peak memory:
+    // the index grid, the path scan and the traced paths still cover the whole image.
+    int tileSize = 0;
+    bool fusedScan = false; // interpolate internodes while scanning, without storing the path points
+
+    // Color quantization
+    QuantizationMethod quantization = QuantizationMethod::Threshold;
+    int colorCount = 16; // palette size for MedianCut and KMeans, at most 255
+    int threshold = 20; // pixels with 255 - value < threshold are light
+    ThresholdChannel thresholdChannel = ThresholdChannel::Luminance;
+
+    // Output
+    float scale = 1.0f;
+    int precision = -1; // decimals of SVG and PDF coordinates, 0 snaps to integers, -1 keeps 6 significant digits
+    bool relativePaths = false; // SVG paths use relative l and q commands after the first point
 };
 
+// Path counts of the last processImage call, hole paths are not included
+struct TraceStats {
+    long pathsScanned = 0;
+    long pathsOmittedByLength = 0; // fewer points than pathomit
+    long pathsOmittedByArea = 0; // enclosing less than minPathArea
+    
+    long pathsKept() const { return pathsScanned - pathsOmittedByLength - pathsOmittedByArea; }
+};
+
+class ColorQuantizer;
+class OutputSink;
+class Exporter;
+
 class ImageTracer{
 
     public:
     
     ImageTracer();
+    explicit ImageTracer(const TracerOptions& options);
+    // threadCount: worker threads used for tracing, 0 uses every hardware thread
+    explicit ImageTracer(int threadCount);
     
+    // Also replaces the color quantizer with the one selected by the options
+    void setOptions(const TracerOptions& options);
+    const TracerOptions& getOptions() const;
+    // Replaces the quantizer selected by the options
+    void setColorQuantizer(std::shared_ptr<ColorQuantizer> quantizer);
+    const TraceStats& getStats() const;
+    
+    // SVG output only
     std::stringstream processImage(uint8_t* pixels, int width, int height);
+    // Writes the SVG to the sink instead of a stream, returns false if writing failed
+    bool processImage(uint8_t* pixels, int width, int height, OutputSink& sink);
+    // Traces the image once and passes it to every exporter, returns false if an export failed
+    bool processImage(uint8_t* pixels, int width, int height, const std::vector<Exporter*>& exporters);
+
+    // Streaming input: each pushed row is quantized and turned into edge nodes together with the
+    // previous one, so neither the RGB image nor the indexed image is stored. Needs a quantizer
+    // with a fixed palette (ThresholdQuantizer or PaletteQuantizer), beginImage returns false otherwise.
+    bool beginImage(int width, int height);
+    // width RGB pixels, rows are pushed from top to bottom
+    void pushRow(const uint8_t* rgb);
+    // Traces the pushed rows, the result is the same as processImage on the whole image
+    std::stringstream finishImage();
+    bool finishImage(OutputSink& sink);
+    bool finishImage(const std::vector<Exporter*>& exporters);
     
 private:
+    struct RowStream;
+    // Runs the stages one at a time in tests/allocation_test.cpp
+    friend struct StageAccess;
+    
+    TracerOptions options;
+    std::shared_ptr<ColorQuantizer> quantizer;
+    TraceStats stats;
+    std::shared_ptr<RowStream> stream;
     
-    IndexedImage colorQuantization(ImageData img);
-    threeDim<int> layering(IndexedImage ii);
-    fourDim<int> batchPathScan(threeDim<int> layers);
-    fourDim<double> batchInternodes(fourDim<int> bPaths);
-    fourDim<double> batchTraceLayers(fourDim<double> binternodes, float ltreshold, float qtreshold);
-    twoDim<double> fitseq(twoDim<double> path, float ltreshold, float qtreshold, int seqstart, int seqend);
-    std::stringstream toSvgStringStream(IndexedImage ii);
-    void exportPDF(IndexedImage ii);
+    int workerCount() const;
+    IndexedImage colorQuantization(const ImageData& img);
+    std::vector<NodeGrid> layering(const IndexedImage& ii);
+    std::vector<SparseNodeGrid> tiledLayering(const IndexedImage& ii);
+    // Layers are NodeGrids or SparseNodeGrids
+    template <class Layer>
+    threeDim<Internode> scanPaths(std::vector<Layer> layers);
+    // Takes ownership of the layers, visited edge nodes are cleared while scanning
+    template <class Layer>
+    threeDim<PathPoint> batchPathScan(std::vector<Layer> layers);
+    threeDim<Internode> batchInternodes(const threeDim<PathPoint>& bPaths);
+    // batchPathScan and batchInternodes in one pass
+    template <class Layer>
+    threeDim<Internode> batchPathScanInternodes(std::vector<Layer> layers);
+    threeDim<Segment> batchTraceLayers(const threeDim<Internode>& binternodes, float ltreshold, float qtreshold);
+    // Traces the paths into ii.layers and passes the result to the exporters
+    bool traceAndExport(IndexedImage& ii, threeDim<Internode> binternodes, const std::vector<Exporter*>& exporters);
+    void tracePath(Span<Internode> path, float ltreshold, float qtreshold, std::vector<Segment>& segments);
+    void fitseq(Span<Internode> path, float ltreshold, float qtreshold, int seqstart, int seqend, std::vector<Segment>& segments);
 
 };
 
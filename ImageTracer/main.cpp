@@ -10,6 +10,10 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #include "image_tracer.hpp"
+#include "output_sink.hpp"
+#include "exporter.hpp"
+#include "gzip_sink.hpp"
+#include <memory>
 #include <unistd.h>
 #include <string>
 #include <stdio.h>
@@ -17,19 +21,44 @@
 #include <sstream>
 #include <fstream>
 
+// ImageTracer [input.png [output.svg [output.pdf]]]
+// An output ending in .svgz is compressed. Without arguments ./testimages/11.png is traced to ./out/test.svg and ./out/test.pdf
 int main(int argc, const char * argv[]) {
     IMGTrace::ImageTracer tracer = IMGTrace::ImageTracer();
+    std::string input = argc > 1 ? argv[1] : "./testimages/11.png";
+    std::string output = argc > 2 ? argv[2] : "./out/test.svg";
+    std::string pdfOutput = argc > 3 ? argv[3] : (argc > 1 ? "" : "./out/test.pdf");
     
     int width, height, bpp;
-    unsigned char* rgb = stbi_load( "./testimages/11.png", &width, &height, &bpp, 3 );
-    std::stringstream result = tracer.processImage(rgb, width, height);
+    unsigned char* rgb = stbi_load( input.c_str(), &width, &height, &bpp, 3 );
+    if (rgb == NULL) {
+        fprintf(stderr, "Error: could not load %s\n", input.c_str());
+        return 1;
+    }
+    IMGTrace::FileSink outFile(output);
+    std::unique_ptr<IMGTrace::GzipSink> gzip;
+    if (output.size() > 5 && output.compare(output.size() - 5, 5, ".svgz") == 0) {
+        gzip.reset(new IMGTrace::GzipSink(outFile));
+    }
+    IMGTrace::SvgExporter svg(gzip ? (IMGTrace::OutputSink&)*gzip : outFile);
+    std::vector<IMGTrace::Exporter*> exporters = { &svg };
+#if IMGTRACE_PDF
+    IMGTrace::PdfExporter pdf(pdfOutput);
+    if (!pdfOutput.empty()) {
+        exporters.push_back(&pdf);
+    }
+#else
+    if (!pdfOutput.empty()) {
+        fprintf(stderr, "PDF Error: built without PDFGen, %s is not written\n", pdfOutput.c_str());
+    }
+#endif
+    bool written = outFile.isOpen() && tracer.processImage(rgb, width, height, exporters);
+    if (gzip && !gzip->finish()) {
+        written = false;
+    }
     stbi_image_free( rgb );
-    
-    std::ofstream outFile("./out/test.svg");
-    outFile << result.rdbuf();
-    outFile.close();
 
-    return 0;
+    return written ? 0 : 1;
 }
 
 
@@ -0,0 +1,115 @@
+//
+//  node_rows.cpp
+//  ImageTracer
+//
+
+#include "node_rows.hpp"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#define IMGTRACE_X86
+#include <immintrin.h>
+#endif
+
+namespace IMGTrace
+{
+
+static inline uint8_t nodeType(const uint8_t* up, const uint8_t* down, int k, uint8_t color) {
+    return (up[k] == color ? 1 : 0) + (up[k+1] == color ? 2 : 0)
+        + (down[k+1] == color ? 4 : 0) + (down[k] == color ? 8 : 0);
+}
+
+static void nodeRowScalar(const uint8_t* up, const uint8_t* down, uint8_t* out, int count, uint8_t color) {
+    int k = 0;
+    for (; k + 1 < count; k += 2) {
+        out[k >> 1] = nodeType(up, down, k, color) | (nodeType(up, down, k + 1, color) << 4);
+    }
+    if (k < count) {
+        out[k >> 1] = nodeType(up, down, k, color);
+    }
+}
+
+#if defined(IMGTRACE_X86) && defined(__GNUC__)
+// Node types of the 16 nodes starting at up and down, one per byte
+__attribute__((target("sse2")))
+static inline __m128i nodeTypesSSE2(const uint8_t* up, const uint8_t* down, __m128i c) {
+    const __m128i b1 = _mm_set1_epi8(1), b2 = _mm_set1_epi8(2), b4 = _mm_set1_epi8(4), b8 = _mm_set1_epi8(8);
+    __m128i tl = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)up), c);
+    __m128i tr = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(up + 1)), c);
+    __m128i br = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(down + 1)), c);
+    __m128i bl = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)down), c);
+    return _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(tl, b1), _mm_and_si128(tr, b2)),
+        _mm_or_si128(_mm_and_si128(br, b4), _mm_and_si128(bl, b8)));
+}
+
+// Moves the odd bytes of a and b into the high nibble of the even ones and packs them into 16 bytes
+__attribute__((target("sse2")))
+static inline __m128i packNodesSSE2(__m128i a, __m128i b) {
+    const __m128i low = _mm_set1_epi16(0x00FF), high = _mm_set1_epi16(0x00F0);
+    a = _mm_or_si128(_mm_and_si128(a, low), _mm_and_si128(_mm_srli_epi16(a, 4), high));
+    b = _mm_or_si128(_mm_and_si128(b, low), _mm_and_si128(_mm_srli_epi16(b, 4), high));
+    return _mm_packus_epi16(a, b);
+}
+
+__attribute__((target("sse2")))
+static void nodeRowSSE2(const uint8_t* up, const uint8_t* down, uint8_t* out, int count, uint8_t color) {
+    const __m128i c = _mm_set1_epi8((char)color);
+    int k = 0;
+    // up[k+32] is the last pixel read, which is still inside the row
+    for (; k + 32 <= count; k += 32) {
+        __m128i a = nodeTypesSSE2(up + k, down + k, c);
+        __m128i b = nodeTypesSSE2(up + k + 16, down + k + 16, c);
+        _mm_storeu_si128((__m128i*)(out + (k >> 1)), packNodesSSE2(a, b));
+    }
+    nodeRowScalar(up + k, down + k, out + (k >> 1), count - k, color);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i nodeTypesAVX2(const uint8_t* up, const uint8_t* down, __m256i c) {
+    const __m256i b1 = _mm256_set1_epi8(1), b2 = _mm256_set1_epi8(2), b4 = _mm256_set1_epi8(4), b8 = _mm256_set1_epi8(8);
+    __m256i tl = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)up), c);
+    __m256i tr = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(up + 1)), c);
+    __m256i br = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(down + 1)), c);
+    __m256i bl = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)down), c);
+    return _mm256_or_si256(
+        _mm256_or_si256(_mm256_and_si256(tl, b1), _mm256_and_si256(tr, b2)),
+        _mm256_or_si256(_mm256_and_si256(br, b4), _mm256_and_si256(bl, b8)));
+}
+
+__attribute__((target("avx2")))
+static void nodeRowAVX2(const uint8_t* up, const uint8_t* down, uint8_t* out, int count, uint8_t color) {
+    const __m256i c = _mm256_set1_epi8((char)color);
+    const __m256i low = _mm256_set1_epi16(0x00FF), high = _mm256_set1_epi16(0x00F0);
+    int k = 0;
+    for (; k + 64 <= count; k += 64) {
+        __m256i a = nodeTypesAVX2(up + k, down + k, c);
+        __m256i b = nodeTypesAVX2(up + k + 32, down + k + 32, c);
+        a = _mm256_or_si256(_mm256_and_si256(a, low), _mm256_and_si256(_mm256_srli_epi16(a, 4), high));
+        b = _mm256_or_si256(_mm256_and_si256(b, low), _mm256_and_si256(_mm256_srli_epi16(b, 4), high));
+        // packus works within 128 bit lanes, the quadwords are put back in order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+        _mm256_storeu_si256((__m256i*)(out + (k >> 1)), packed);
+    }
+    nodeRowSSE2(up + k, down + k, out + (k >> 1), count - k, color);
+}
+#endif
+
+NodeRowKernel nodeRowKernel() {
+    static const NodeRowKernel kernel = nodeRowKernels().back().kernel;
+    return kernel;
+}
+
+std::vector<NamedNodeRowKernel> nodeRowKernels() {
+    std::vector<NamedNodeRowKernel> kernels = { { "scalar", nodeRowScalar } };
+#if defined(IMGTRACE_X86) && defined(__GNUC__)
+    if (__builtin_cpu_supports("sse2")) {
+        kernels.push_back({ "sse2", nodeRowSSE2 });
+        if (__builtin_cpu_supports("avx2")) {
+            kernels.push_back({ "avx2", nodeRowAVX2 });
+        }
+    }
+#endif
+    return kernels;
+}
+
+}
@@ -0,0 +1,35 @@
+//
+//  node_rows.hpp
+//  ImageTracer
+//
+
+#ifndef node_rows_hpp
+#define node_rows_hpp
+
+#include <stdint.h>
+#include <vector>
+
+namespace IMGTrace
+{
+
+// Node types of one layer color for count nodes of a row, packed two per byte into out:
+// up and down point to the pixel rows above and below the nodes, starting at the pixel left
+// of the first node, which is stored in the low nibble of out[0]. Reads count + 1 pixels of
+// each row and writes (count + 1) / 2 bytes.
+typedef void (*NodeRowKernel)(const uint8_t* up, const uint8_t* down, uint8_t* out, int count, uint8_t color);
+
+struct NamedNodeRowKernel {
+    const char* name;
+    NodeRowKernel kernel;
+};
+
+// Widest kernel the CPU supports, picked once
+NodeRowKernel nodeRowKernel();
+
+// Every kernel the CPU supports, the scalar one first, so the vector kernels can be
+// compared with it
+std::vector<NamedNodeRowKernel> nodeRowKernels();
+
+}
+
+#endif /* node_rows_hpp */
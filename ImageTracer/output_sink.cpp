@@ -0,0 +1,53 @@
+//
+//  output_sink.cpp
+//  ImageTracer
+//
+
+#include "output_sink.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace IMGTrace
+{
+
+FileSink::FileSink(int fd) : fd(fd), owned(false) {}
+
+FileSink::FileSink(const std::string& path)
+    : fd(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)), owned(true) {}
+
+FileSink::~FileSink() {
+    if (owned && fd >= 0) {
+        close(fd);
+    }
+}
+
+bool FileSink::write(const char* data, size_t size) {
+    if (fd < 0) {
+        return false;
+    }
+    // write() may take only a part of the bytes
+    while (size > 0) {
+        ssize_t written = ::write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+bool FileSink::flush() {
+    return fd >= 0;
+}
+
+bool StringSink::write(const char* data, size_t size) {
+    this->data.append(data, size);
+    return true;
+}
+
+}
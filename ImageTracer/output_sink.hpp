@@ -0,0 +1,59 @@
+//
+//  output_sink.hpp
+//  ImageTracer
+//
+
+#ifndef output_sink_hpp
+#define output_sink_hpp
+
+#include <stddef.h>
+#include <string>
+
+namespace IMGTrace
+{
+
+// Destination of exported bytes
+class OutputSink {
+public:
+    virtual ~OutputSink() {}
+
+    // Returns false if the bytes could not be written
+    virtual bool write(const char* data, size_t size) = 0;
+    virtual bool flush() { return true; }
+};
+
+// Writes to a file descriptor, or to a file it creates
+class FileSink : public OutputSink {
+public:
+    // The descriptor is not closed by the sink
+    explicit FileSink(int fd);
+    // Creates or truncates the file, see isOpen
+    explicit FileSink(const std::string& path);
+    ~FileSink() override;
+
+    FileSink(const FileSink&) = delete;
+    FileSink& operator=(const FileSink&) = delete;
+
+    bool isOpen() const { return fd >= 0; }
+    bool write(const char* data, size_t size) override;
+    bool flush() override;
+
+private:
+    int fd;
+    bool owned;
+};
+
+// Appends to a string
+class StringSink : public OutputSink {
+public:
+    bool write(const char* data, size_t size) override;
+
+    std::string& str() { return data; }
+
+private:
+    std::string data;
+};
+
+}
+
+#endif /* output_sink_hpp */
@@ -0,0 +1,259 @@
+//
+//  svg_writer.cpp
+//  ImageTracer
+//
+
+#include "svg_writer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+
+namespace IMGTrace
+{
+
+static const size_t bufferSize = 64 * 1024;
+// Longest formatted number, "%.15g" of a double takes at most 23 bytes
+static const size_t maxNumberLength = 32;
+
+// Decimals printed with integer arithmetic, more are printed with snprintf
+static const int maxFixedDecimals = 9;
+
+SvgWriter::SvgWriter(OutputSink& sink, float scale, int precision, bool relative)
+    : sink(sink), scale(scale), precision(precision), factor(std::pow(10.0, std::max(precision, 0))),
+      relative(relative), buffer(bufferSize) {}
+
+void SvgWriter::flushBuffer() {
+    if (used > 0 && !failed && !sink.write(buffer.data(), used)) {
+        failed = true;
+    }
+    used = 0;
+}
+
+void SvgWriter::text(const char* str, size_t length) {
+    memcpy(reserve(length), str, length);
+    used += length;
+}
+
+void SvgWriter::integer(int value) {
+    char* out = reserve(maxNumberLength);
+    char digits[16];
+    int count = 0;
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+    do {
+        digits[count++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (value < 0) {
+        *out++ = '-';
+        used++;
+    }
+    while (count > 0) {
+        *out++ = digits[--count];
+        used++;
+    }
+}
+
+double roundCoordinate(double value, int precision) {
+    if (precision < 0) {
+        return value;
+    }
+    double factor = std::pow(10.0, precision);
+    return std::round(value * factor) / factor;
+}
+
+static const double powersOf10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10 };
+
+// printf("%g") without the formatting machinery: 6 significant digits, no trailing zeros.
+// Values printed with an exponent and values too close to a rounding tie to be sure about
+// the last digit are left to snprintf.
+static int formatGeneral(double value, char* out) {
+    if (value == 0.0 || !std::isfinite(value)) {
+        return snprintf(out, maxNumberLength, "%g", value);
+    }
+    char* start = out;
+    double magnitude = std::fabs(value);
+    // Decimal exponent, log10 may be off by one next to powers of 10
+    int exponent = (int)std::floor(std::log10(magnitude));
+    if (exponent < -4 || exponent >= 6) {
+        return snprintf(out, maxNumberLength, "%g", value);
+    }
+    if (magnitude < (exponent >= 0 ? powersOf10[exponent] : 1.0 / powersOf10[-exponent])) {
+        exponent--;
+    } else if (exponent + 1 < 6 && magnitude >= (exponent + 1 >= 0 ? powersOf10[exponent + 1] : 1.0 / powersOf10[-exponent - 1])) {
+        exponent++;
+    }
+    if (exponent < -4 || exponent >= 6) {
+        return snprintf(out, maxNumberLength, "%g", value);
+    }
+
+    // The 6 significant digits as an integer, rounded half to even like printf
+    double scaled = magnitude * powersOf10[5 - exponent];
+    double below = std::floor(scaled);
+    if (std::fabs(scaled - below - 0.5) < 1e-6) {
+        return snprintf(out, maxNumberLength, "%g", value);
+    }
+    long digits = (long)std::nearbyint(scaled);
+    if (digits >= 1000000) {
+        // Rounded up to the next power of 10
+        digits /= 10;
+        exponent++;
+        if (exponent >= 6) {
+            return snprintf(out, maxNumberLength, "%g", value);
+        }
+    }
+
+    char text[6];
+    for (int k = 5; k >= 0; k--) {
+        text[k] = (char)('0' + digits % 10);
+        digits /= 10;
+    }
+    int length = 6;
+    if (value < 0) {
+        *out++ = '-';
+    }
+    if (exponent >= 0) {
+        // Digits after the point without trailing zeros
+        int integerDigits = exponent + 1;
+        while (length > integerDigits && text[length - 1] == '0') {
+            length--;
+        }
+        for (int k = 0; k < integerDigits; k++) {
+            *out++ = text[k];
+        }
+        if (length > integerDigits) {
+            *out++ = '.';
+            for (int k = integerDigits; k < length; k++) {
+                *out++ = text[k];
+            }
+        }
+    } else {
+        while (text[length - 1] == '0') {
+            length--;
+        }
+        *out++ = '0';
+        *out++ = '.';
+        for (int k = 1; k < -exponent; k++) {
+            *out++ = '0';
+        }
+        for (int k = 0; k < length; k++) {
+            *out++ = text[k];
+        }
+    }
+    return (int)(out - start);
+}
+
+// units / 10^decimals without trailing zeros in the fraction, decimals is at most 9
+static int formatFixed(long long units, int decimals, char* out) {
+    char* start = out;
+    unsigned long long magnitude = units < 0 ? 0ull - (unsigned long long)units : (unsigned long long)units;
+    unsigned long long factor = (unsigned long long)powersOf10[decimals];
+    unsigned long long integerPart = magnitude / factor, fractionPart = magnitude % factor;
+    if (units < 0) {
+        *out++ = '-';
+    }
+    char digits[24];
+    int count = 0;
+    do {
+        digits[count++] = (char)('0' + integerPart % 10);
+        integerPart /= 10;
+    } while (integerPart > 0);
+    while (count > 0) {
+        *out++ = digits[--count];
+    }
+    if (fractionPart > 0) {
+        // Fraction digits without the trailing zeros
+        int length = decimals;
+        while (fractionPart % 10 == 0) {
+            fractionPart /= 10;
+            length--;
+        }
+        *out++ = '.';
+        for (int k = length - 1; k >= 0; k--) {
+            out[k] = (char)('0' + fractionPart % 10);
+            fractionPart /= 10;
+        }
+        out += length;
+    }
+    return (int)(out - start);
+}
+
+// Same digits as an std::ostream with default formatting
+void SvgWriter::fraction(double value) {
+    used += formatGeneral(value, reserve(maxNumberLength));
+}
+
+double SvgWriter::units(float value) const {
+    float scaled = value * scale;
+    return precision < 0 ? scaled : std::round(scaled * factor);
+}
+
+void SvgWriter::number(double units) {
+    char* out = reserve(maxNumberLength);
+    if (precision < 0) {
+        used += formatGeneral(units, out);
+    } else if (precision <= maxFixedDecimals) {
+        used += formatFixed((long long)units, precision, out);
+    } else {
+        // Enough digits to print the rounded coordinates exactly
+        used += snprintf(out, maxNumberLength, "%.15g", units / factor);
+    }
+}
+
+void SvgWriter::point(float x, float y, bool offset) {
+    double ux = units(x), uy = units(y);
+    number(offset ? ux - currentX : ux); text(" ");
+    number(offset ? uy - currentY : uy); text(" ");
+}
+
+void SvgWriter::moveTo(float x, float y) {
+    currentX = units(x);
+    currentY = units(y);
+}
+
+void SvgWriter::begin(int width, int height) {
+    text("<svg width=\"");
+    integer(width);
+    text("\" height=\"");
+    integer(height);
+    text("\" version=\"1.1\" xmlns=\"http://www.w3.org/2000/svg\">");
+}
+
+void SvgWriter::path(const std::vector<Segment>& segments, const Color& color) {
+    text("<path fill=\"rgb(");
+    integer(color.r); text(","); integer(color.g); text(","); integer(color.b);
+    text(")\" stroke=\"rgb(");
+    integer(color.r); text(","); integer(color.g); text(","); integer(color.b);
+    text(")\" stroke-width=\"1\" opacity=\"");
+    fraction(color.a / 255.0);
+    text("\" d=\"M ");
+    // The start point is absolute in both modes
+    point(segments[0].x1, segments[0].y1, false);
+    moveTo(segments[0].x1, segments[0].y1);
+
+    // Relative offsets are differences of the rounded positions, so rounding errors don't add up
+    for (const Segment& segment : segments) {
+        if (segment.type == SegmentType::Line) {
+            text(relative ? "l " : "L ");
+            point(segment.x2, segment.y2, relative);
+            moveTo(segment.x2, segment.y2);
+        } else {
+            text(relative ? "q " : "Q ");
+            point(segment.x2, segment.y2, relative);
+            point(segment.x3, segment.y3, relative);
+            moveTo(segment.x3, segment.y3);
+        }
+    }
+
+    text("Z\" />");
+}
+
+bool SvgWriter::end() {
+    text("</svg>");
+    flushBuffer();
+    if (!failed && !sink.flush()) {
+        failed = true;
+    }
+    return !failed;
+}
+
+}
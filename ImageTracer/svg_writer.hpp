@@ -0,0 +1,67 @@
+//
+//  svg_writer.hpp
+//  ImageTracer
+//
+
+#ifndef svg_writer_hpp
+#define svg_writer_hpp
+
+#include "image_tracer.hpp"
+#include "output_sink.hpp"
+
+namespace IMGTrace
+{
+
+// Writes an SVG document to a sink. Text and numbers are formatted straight into a buffer,
+// which is passed to the sink whenever it is full, so writing doesn't allocate.
+class SvgWriter {
+public:
+    // Coordinates are multiplied by scale. precision is the number of decimals, -1 prints
+    // 6 significant digits like the default stream formatting. Relative paths use l and q
+    // commands after the first point.
+    SvgWriter(OutputSink& sink, float scale = 1.0f, int precision = -1, bool relative = false);
+
+    void begin(int width, int height);
+    void path(const std::vector<Segment>& segments, const Color& color);
+    // Passes the rest of the buffer to the sink, returns false if any write failed
+    bool end();
+
+private:
+    OutputSink& sink;
+    float scale;
+    int precision;
+    double factor; // 10^precision
+    bool relative;
+    // End of the last segment in output units
+    double currentX = 0.0, currentY = 0.0;
+    std::vector<char> buffer;
+    size_t used = 0;
+    bool failed = false;
+
+    void flushBuffer();
+    // Makes room for size more bytes
+    char* reserve(size_t size) {
+        if (used + size > buffer.size()) {
+            flushBuffer();
+        }
+        return buffer.data() + used;
+    }
+    void text(const char* str, size_t length);
+    template <size_t N>
+    void text(const char (&str)[N]) { text(str, N - 1); }
+    void integer(int value);
+    void fraction(double value);
+    // Scaled coordinate, in multiples of 10^-precision if precision is set
+    double units(float value) const;
+    void number(double units);
+    // Writes "x y ", relative to the current point if offset is set
+    void point(float x, float y, bool offset);
+    void moveTo(float x, float y);
+};
+
+// Rounds to the given number of decimals, negative precision keeps the value
+double roundCoordinate(double value, int precision);
+
+}
+
+#endif /* svg_writer_hpp */
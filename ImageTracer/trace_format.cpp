@@ -0,0 +1,383 @@
+//
+//  trace_format.cpp
+//  ImageTracer
+//
+
+#include "trace_format.hpp"
+#include "svg_writer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace IMGTrace
+{
+
+static const char traceMagic[4] = { 'I', 'T', 'R', 'C' };
+static const size_t bufferSize = 64 * 1024;
+
+static_assert(sizeof(TraceHeader) == 40, "TraceHeader has no padding");
+static_assert(sizeof(TracePath) == 16, "TracePath has no padding");
+
+static uint64_t alignSection(uint64_t size) {
+    return (size + 3) & ~(uint64_t)3;
+}
+
+// Coordinates of a path after its start point
+static uint32_t segmentCoordinates(SegmentType type) {
+    return type == SegmentType::Line ? 2 : 4;
+}
+
+// Writing
+
+// Collects the sections in a buffer, which is passed to the sink whenever it is full
+class TraceBuffer {
+public:
+    explicit TraceBuffer(OutputSink& sink) : sink(sink) {
+        buffer.reserve(bufferSize);
+    }
+
+    template <class T>
+    void put(const T& value) {
+        bytes(&value, sizeof(T));
+    }
+
+    void bytes(const void* data, size_t size) {
+        if (buffer.size() + size > bufferSize) {
+            flushBuffer();
+        }
+        const char* first = (const char*)data;
+        buffer.insert(buffer.end(), first, first + size);
+        written += size;
+    }
+
+    void pad() {
+        static const char zeros[4] = {};
+        bytes(zeros, alignSection(written) - written);
+    }
+
+    bool end() {
+        flushBuffer();
+        if (!failed && !sink.flush()) {
+            failed = true;
+        }
+        return !failed;
+    }
+
+private:
+    OutputSink& sink;
+    std::vector<char> buffer;
+    uint64_t written = 0;
+    bool failed = false;
+
+    void flushBuffer() {
+        if (!buffer.empty() && !failed && !sink.write(buffer.data(), buffer.size())) {
+            failed = true;
+        }
+        buffer.clear();
+    }
+};
+
+bool writeTrace(const IndexedImage& ii, float scale, OutputSink& sink, TraceCoordinates coordinates, int fractionBits) {
+    bool fixed = coordinates == TraceCoordinates::Fixed;
+    fractionBits = fixed ? std::min(std::max(fractionBits, 0), 16) : 0;
+    uint32_t colorCount = (uint32_t)ii.layers.size();
+
+    // Paths are numbered in layer order
+    std::vector<uint32_t> layerStart(colorCount + 1, 0);
+    uint32_t segmentCount = 0, coordinateCount = 0;
+    for (uint32_t layer = 0; layer < colorCount; layer++) {
+        layerStart[layer + 1] = layerStart[layer] + (uint32_t)ii.layers[layer].size();
+        for (const std::vector<Segment>& path : ii.layers[layer]) {
+            segmentCount += (uint32_t)path.size();
+            coordinateCount += path.empty() ? 0 : 2;
+            for (const Segment& segment : path) {
+                coordinateCount += segmentCoordinates(segment.type);
+            }
+        }
+    }
+
+    TraceBuffer out(sink);
+    TraceHeader header;
+    memcpy(header.magic, traceMagic, sizeof(traceMagic));
+    header.version = traceFormatVersion;
+    header.coordinates = (uint16_t)coordinates;
+    header.width = ii.width;
+    header.height = ii.height;
+    header.scale = scale;
+    header.fractionBits = fractionBits;
+    header.colorCount = colorCount;
+    header.pathCount = layerStart[colorCount];
+    header.segmentCount = segmentCount;
+    header.coordinateCount = coordinateCount;
+    out.put(header);
+
+    for (uint32_t layer = 0; layer < colorCount; layer++) {
+        const Color& color = ii.palette[layer];
+        uint8_t rgba[4] = {
+            (uint8_t)std::min(std::max(color.r, 0), 255), (uint8_t)std::min(std::max(color.g, 0), 255),
+            (uint8_t)std::min(std::max(color.b, 0), 255), (uint8_t)std::min(std::max(color.a, 0), 255)
+        };
+        out.bytes(rgba, sizeof(rgba));
+    }
+    out.bytes(layerStart.data(), layerStart.size() * sizeof(uint32_t));
+
+    TracePath entry = {};
+    for (uint32_t layer = 0; layer < colorCount; layer++) {
+        entry.layer = layer;
+        for (const std::vector<Segment>& path : ii.layers[layer]) {
+            entry.segmentCount = (uint32_t)path.size();
+            out.put(entry);
+            entry.firstSegment += entry.segmentCount;
+            entry.firstCoordinate += path.empty() ? 0 : 2;
+            for (const Segment& segment : path) {
+                entry.firstCoordinate += segmentCoordinates(segment.type);
+            }
+        }
+    }
+
+    for (const PathRef& ref : ii.zorder) {
+        out.put(layerStart[ref.layer] + ref.path);
+    }
+
+    for (const twoDim<Segment>& layer : ii.layers) {
+        for (const std::vector<Segment>& path : layer) {
+            for (const Segment& segment : path) {
+                out.put(segment.type);
+            }
+        }
+    }
+    out.pad();
+
+    float factor = (float)(1 << fractionBits);
+    auto coordinate = [&](float value) {
+        if (!fixed) {
+            out.put(value);
+            return;
+        }
+        double units = std::round((double)value * factor);
+        out.put((int32_t)std::min(std::max(units, (double)INT32_MIN), (double)INT32_MAX));
+    };
+    for (const twoDim<Segment>& layer : ii.layers) {
+        for (const std::vector<Segment>& path : layer) {
+            if (path.empty()) {
+                continue;
+            }
+            coordinate(path[0].x1); coordinate(path[0].y1);
+            for (const Segment& segment : path) {
+                coordinate(segment.x2); coordinate(segment.y2);
+                if (segment.type == SegmentType::Quad) {
+                    coordinate(segment.x3); coordinate(segment.y3);
+                }
+            }
+        }
+    }
+
+    return out.end();
+}
+
+// Reading
+
+TraceView::TraceView(const void* data, size_t size) {
+    header = (const TraceHeader*)data;
+    if (!validate(size)) {
+        header = nullptr;
+    }
+}
+
+bool TraceView::validate(size_t size) {
+    if (header == nullptr || (uintptr_t)header % 4 != 0 || size < sizeof(TraceHeader)) {
+        return false;
+    }
+    if (memcmp(header->magic, traceMagic, sizeof(traceMagic)) != 0 || header->version != traceFormatVersion) {
+        return false;
+    }
+    if (header->coordinates == (uint16_t)TraceCoordinates::Float) {
+        if (header->fractionBits != 0) {
+            return false;
+        }
+    } else if (header->coordinates != (uint16_t)TraceCoordinates::Fixed || header->fractionBits > 16) {
+        return false;
+    }
+    fixedFactor = 1.0f / (float)(1 << header->fractionBits);
+
+    // Section offsets, 64 bit sums of 32 bit counts don't overflow
+    const uint8_t* base = (const uint8_t*)header;
+    uint64_t colorCount = header->colorCount, pathCount = header->pathCount;
+    uint64_t offset = sizeof(TraceHeader);
+    uint64_t paletteOffset = offset;
+    offset += colorCount * 4;
+    uint64_t layersOffset = offset;
+    offset += (colorCount + 1) * sizeof(uint32_t);
+    uint64_t pathsOffset = offset;
+    offset += pathCount * sizeof(TracePath);
+    uint64_t zorderOffset = offset;
+    offset += pathCount * sizeof(uint32_t);
+    uint64_t tagsOffset = offset;
+    offset += alignSection(header->segmentCount);
+    uint64_t coordinatesOffset = offset;
+    offset += (uint64_t)header->coordinateCount * 4;
+    if (offset > size) {
+        return false;
+    }
+    palette = base + paletteOffset;
+    layers = (const uint32_t*)(base + layersOffset);
+    paths = (const TracePath*)(base + pathsOffset);
+    zorder = (const uint32_t*)(base + zorderOffset);
+    tags = base + tagsOffset;
+    coordinates = base + coordinatesOffset;
+
+    // Indices, so the accessors can trust them
+    if (layers[0] != 0 || layers[colorCount] != pathCount) {
+        return false;
+    }
+    for (uint64_t layer = 0; layer < colorCount; layer++) {
+        if (layers[layer] > layers[layer + 1]) {
+            return false;
+        }
+    }
+    for (uint32_t segment = 0; segment < header->segmentCount; segment++) {
+        if (tags[segment] != (uint8_t)SegmentType::Line && tags[segment] != (uint8_t)SegmentType::Quad) {
+            return false;
+        }
+    }
+    // Paths are stored back to back, so every segment and coordinate is visited once
+    uint64_t segment = 0, coordinate = 0;
+    for (uint32_t index = 0; index < pathCount; index++) {
+        const TracePath& path = paths[index];
+        if (path.layer >= colorCount || index < layers[path.layer] || index >= layers[path.layer + 1]) {
+            return false;
+        }
+        if (path.firstSegment != segment || path.firstCoordinate != coordinate ||
+            segment + path.segmentCount > header->segmentCount) {
+            return false;
+        }
+        coordinate += path.segmentCount > 0 ? 2 : 0;
+        for (uint64_t end = segment + path.segmentCount; segment < end; segment++) {
+            coordinate += segmentCoordinates((SegmentType)tags[segment]);
+        }
+        if (coordinate > header->coordinateCount) {
+            return false;
+        }
+    }
+    if (segment != header->segmentCount || coordinate != header->coordinateCount) {
+        return false;
+    }
+    for (uint32_t position = 0; position < pathCount; position++) {
+        if (zorder[position] >= pathCount) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Color TraceView::getColor(uint32_t layer) const {
+    const uint8_t* rgba = palette + layer * 4;
+    return { rgba[0], rgba[1], rgba[2], rgba[3] };
+}
+
+float TraceView::getCoordinate(uint32_t index) const {
+    if (header->coordinates == (uint16_t)TraceCoordinates::Float) {
+        float value;
+        memcpy(&value, coordinates + (size_t)index * 4, sizeof(value));
+        return value;
+    }
+    int32_t units;
+    memcpy(&units, coordinates + (size_t)index * 4, sizeof(units));
+    return (float)units * fixedFactor;
+}
+
+void TraceView::getSegments(uint32_t path, std::vector<Segment>& segments) const {
+    const TracePath& entry = paths[path];
+    segments.clear();
+    if (entry.segmentCount == 0) {
+        return;
+    }
+    uint32_t index = entry.firstCoordinate;
+    float x = getCoordinate(index), y = getCoordinate(index + 1);
+    index += 2;
+    for (uint32_t k = 0; k < entry.segmentCount; k++) {
+        Segment segment = {};
+        segment.type = getTag(entry.firstSegment + k);
+        segment.x1 = x;
+        segment.y1 = y;
+        segment.x2 = getCoordinate(index);
+        segment.y2 = getCoordinate(index + 1);
+        index += 2;
+        if (segment.type == SegmentType::Quad) {
+            segment.x3 = getCoordinate(index);
+            segment.y3 = getCoordinate(index + 1);
+            index += 2;
+            x = segment.x3;
+            y = segment.y3;
+        } else {
+            x = segment.x2;
+            y = segment.y2;
+        }
+        segments.push_back(segment);
+    }
+}
+
+TraceFile::TraceFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Trace Error: could not open %s\n", path.c_str());
+        return;
+    }
+    struct stat file;
+    if (fstat(fd, &file) == 0 && file.st_size > 0) {
+        size = (size_t)file.st_size;
+        data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            data = nullptr;
+            size = 0;
+        }
+    }
+    close(fd);
+    if (data == nullptr) {
+        fprintf(stderr, "Trace Error: could not map %s\n", path.c_str());
+        return;
+    }
+    trace = TraceView(data, size);
+    if (!trace.isValid()) {
+        fprintf(stderr, "Trace Error: %s is not a version %d trace\n", path.c_str(), traceFormatVersion);
+    }
+}
+
+TraceFile::~TraceFile() {
+    if (data != nullptr) {
+        munmap(data, size);
+    }
+}
+
+// Conversion
+
+bool traceToSvg(const TraceView& trace, OutputSink& sink, int precision, bool relative) {
+    if (!trace.isValid()) {
+        return false;
+    }
+    float scale = trace.getScale();
+    int w = (int) (trace.getWidth() * scale), h = (int) (trace.getHeight() * scale);
+    SvgWriter writer(sink, scale, precision, relative);
+    writer.begin(w, h);
+
+    std::vector<Segment> segments;
+    for (uint32_t position = 0; position < trace.getPathCount(); position++) {
+        uint32_t path = trace.getZOrder(position);
+        trace.getSegments(path, segments);
+        if (!segments.empty()) {
+            writer.path(segments, trace.getColor(trace.getPath(path).layer));
+        }
+    }
+
+    if (!writer.end()) {
+        fprintf(stderr, "SVG Error: writing the output failed\n");
+        return false;
+    }
+    return true;
+}
+
+}
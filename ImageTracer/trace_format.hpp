@@ -0,0 +1,127 @@
+//
+//  trace_format.hpp
+//  ImageTracer
+//
+
+#ifndef trace_format_hpp
+#define trace_format_hpp
+
+#include "image_tracer.hpp"
+#include "output_sink.hpp"
+
+namespace IMGTrace
+{
+
+// Binary trace format, the traced layers without any text formatting. Fields are little-endian
+// and every section starts at a multiple of 4 bytes, so a mapped file is read in place.
+//
+//   header       TraceHeader
+//   palette      colorCount RGBA colors, 4 bytes each
+//   layers       colorCount + 1 path indices, the paths of layer l are [layers[l], layers[l + 1])
+//   paths        pathCount TracePath entries
+//   zorder       pathCount path indices in drawing order
+//   tags         segmentCount SegmentType bytes, padded to 4 bytes
+//   coordinates  coordinateCount values, the start point of every path followed by x2 y2 of
+//                its lines and x2 y2 x3 y3 of its quadratic segments
+//
+// Readers reject other versions, a new field or section needs a new version. Paths are stored
+// back to back: the segments and coordinates of a path follow those of the previous path.
+
+// Sections are written and read in host byte order
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "The trace format needs a little-endian host"
+#endif
+
+const uint16_t traceFormatVersion = 1;
+
+enum class TraceCoordinates : uint16_t {
+    Float = 0, // float32, same values as the traced segments
+    Fixed = 1  // int32 fixed point, value * 2^fractionBits rounded to the nearest integer
+};
+
+struct TraceHeader {
+    char magic[4]; // "ITRC"
+    uint16_t version;
+    uint16_t coordinates; // TraceCoordinates
+    uint32_t width, height; // traced image size in pixels
+    float scale; // output scale of the tracer, applied when the trace is drawn
+    uint32_t fractionBits; // 0 for float coordinates
+    uint32_t colorCount, pathCount, segmentCount, coordinateCount;
+};
+
+struct TracePath {
+    uint32_t layer; // palette index
+    uint32_t firstSegment, segmentCount;
+    uint32_t firstCoordinate;
+};
+
+// Writes the layers of a traced image, paths are stored in layer order and drawn in ii.zorder.
+// fractionBits of fixed point coordinates is clamped to 0..16. Returns false if writing failed.
+bool writeTrace(const IndexedImage& ii, float scale, OutputSink& sink,
+                TraceCoordinates coordinates = TraceCoordinates::Float, int fractionBits = 8);
+
+// Reads a trace from memory without copying it. The data must stay alive while the view is
+// used and start at a multiple of 4 bytes. Every index in the data is checked when the view is
+// created, in time linear in the size of the data, so the accessors don't check them again.
+class TraceView {
+public:
+    TraceView() {}
+    TraceView(const void* data, size_t size);
+
+    bool isValid() const { return header != nullptr; }
+
+    int getWidth() const { return header->width; }
+    int getHeight() const { return header->height; }
+    float getScale() const { return header->scale; }
+    uint32_t getColorCount() const { return header->colorCount; }
+    uint32_t getPathCount() const { return header->pathCount; }
+    Color getColor(uint32_t layer) const;
+    // Paths of a layer are [layerBegin(layer), layerEnd(layer))
+    uint32_t layerBegin(uint32_t layer) const { return layers[layer]; }
+    uint32_t layerEnd(uint32_t layer) const { return layers[layer + 1]; }
+    const TracePath& getPath(uint32_t path) const { return paths[path]; }
+    // Path drawn at the given position
+    uint32_t getZOrder(uint32_t position) const { return zorder[position]; }
+    SegmentType getTag(uint32_t segment) const { return (SegmentType)tags[segment]; }
+    float getCoordinate(uint32_t index) const;
+
+    // Segments of a path, x1 and y1 of a segment are the end point of the previous one
+    void getSegments(uint32_t path, std::vector<Segment>& segments) const;
+
+private:
+    const TraceHeader* header = nullptr;
+    const uint8_t* palette = nullptr;
+    const uint32_t* layers = nullptr;
+    const TracePath* paths = nullptr;
+    const uint32_t* zorder = nullptr;
+    const uint8_t* tags = nullptr;
+    const uint8_t* coordinates = nullptr;
+    float fixedFactor = 1.0f; // 2^-fractionBits
+
+    bool validate(size_t size);
+};
+
+// Maps a trace file into memory, see isValid
+class TraceFile {
+public:
+    explicit TraceFile(const std::string& path);
+    ~TraceFile();
+
+    TraceFile(const TraceFile&) = delete;
+    TraceFile& operator=(const TraceFile&) = delete;
+
+    bool isValid() const { return trace.isValid(); }
+    const TraceView& view() const { return trace; }
+
+private:
+    void* data = nullptr;
+    size_t size = 0;
+    TraceView trace;
+};
+
+// Writes the trace as an SVG document, the same one the tracer writes with these output options
+bool traceToSvg(const TraceView& trace, OutputSink& sink, int precision = -1, bool relative = false);
+
+}
+
+#endif /* trace_format_hpp */
@@ -0,0 +1,91 @@
+//
+//  fitseq_benchmark.cpp
+//  ImageTracer
+//
+//  Traces a wavy band whose outline grows with the image width and times the tracing stage
+//  (batchTraceLayers, which fits the path sequences). The time per internode stays about the
+//  same as the paths get longer when tracing is linear in the path length.
+//  fitseq_benchmark [longest width]
+//
+
+#include "image_tracer.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+namespace IMGTrace
+{
+
+// Friend of ImageTracer, calls its private stages
+struct StageAccess {
+    ImageTracer& tracer;
+
+    IndexedImage colorQuantization(const ImageData& img) { return tracer.colorQuantization(img); }
+    threeDim<Internode> scanPaths(const IndexedImage& ii) { return tracer.scanPaths(tracer.layering(ii)); }
+    threeDim<Segment> batchTraceLayers(const threeDim<Internode>& binternodes) {
+        return tracer.batchTraceLayers(binternodes, tracer.options.ltres, tracer.options.qtres);
+    }
+};
+
+}
+
+using namespace IMGTrace;
+
+static const int bandHeight = 96;
+static const int repeats = 5; // the fastest run is reported
+
+// White image with a black band following a sine wave, one path whose length grows with width
+static std::vector<uint8_t> waveImage(int width) {
+    std::vector<uint8_t> rgb((size_t)width * bandHeight * 3, 255);
+    for (int x = 0; x < width; x++) {
+        int top = (int)(bandHeight / 2 + 30 * std::sin(x * 0.05) + 8 * std::sin(x * 0.31));
+        for (int y = top - 6; y < top + 6; y++) {
+            uint8_t* p = &rgb[((size_t)y * width + x) * 3];
+            p[0] = p[1] = p[2] = 0;
+        }
+    }
+    return rgb;
+}
+
+int main(int argc, const char * argv[]) {
+    int maxWidth = argc > 1 ? atoi(argv[1]) : 256000;
+    printf("fitseq_benchmark - %10s %12s %10s %12s %14s\n", "width", "internodes", "segments", "trace ms", "ns/internode");
+
+    TracerOptions options;
+    options.pathomit = 0.0f;
+    ImageTracer tracer(options);
+    StageAccess stages = { tracer };
+    for (int width = 1000; width <= maxWidth; width *= 2) {
+        std::vector<uint8_t> rgb = waveImage(width);
+        ImageData img = { width, bandHeight, rgb.data() };
+        IndexedImage ii = stages.colorQuantization(img);
+        threeDim<Internode> binternodes = stages.scanPaths(ii);
+
+        long internodes = 0;
+        for (const auto& layer : binternodes) {
+            for (const auto& path : layer) {
+                internodes += (long)path.size();
+            }
+        }
+        double best = 1e30;
+        long segments = 0;
+        for (int r = 0; r < repeats; r++) {
+            auto start = std::chrono::steady_clock::now();
+            threeDim<Segment> layers = stages.batchTraceLayers(binternodes);
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            best = std::min(best, elapsed.count());
+            segments = 0;
+            for (const auto& layer : layers) {
+                for (const auto& path : layer) {
+                    segments += (long)path.size();
+                }
+            }
+        }
+        printf("fitseq_benchmark - %10d %12ld %10ld %12.3f %14.1f\n", width, internodes, segments, best,
+               best * 1e6 / std::max(internodes, 1L));
+    }
+    return 0;
+}
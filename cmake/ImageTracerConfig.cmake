@@ -0,0 +1,4 @@
+# Package file of an installed ImageTracer, see install() in CMakeLists.txt
+include(CMakeFindDependencyMacro)
+find_dependency(Threads)
+include("${CMAKE_CURRENT_LIST_DIR}/ImageTracerTargets.cmake")
@@ -0,0 +1,273 @@
+//
+//  allocation_test.cpp
+//  ImageTracer
+//
+//  Runs the pipeline stages one at a time under a counting operator new. Every stage may keep
+//  only its own output: the bytes it allocated that are still alive afterwards must fit the
+//  output. On a large image with few paths the input of every stage outweighs its work, there
+//  the bytes a stage allocates and frees again (scratch) must stay below its input, which a
+//  stage that copies its input exceeds.
+//  allocation_test [testimages directory]
+//
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include "image_tracer.hpp"
+#include "color_quantizer.hpp"
+#include "exporter.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+#include <string>
+#include <vector>
+
+// Allocations carry their size and the stage that made them in a header in front of the block
+struct AllocationHeader {
+    size_t size;
+    int stage;
+};
+static const size_t headerSize = 16; // keeps the alignment of malloc
+static_assert(sizeof(AllocationHeader) <= headerSize, "header does not fit");
+
+static std::atomic<int> currentStage(0); // 0 outside of measured stages
+static std::atomic<long long> allocatedBytes(0), keptBytes(0);
+
+void* operator new(size_t size) {
+    void* block = malloc(size + headerSize);
+    if (block == nullptr) {
+        throw std::bad_alloc();
+    }
+    int stage = currentStage;
+    *(AllocationHeader*)block = { size, stage };
+    if (stage != 0) {
+        allocatedBytes += size;
+        keptBytes += size;
+    }
+    return (char*)block + headerSize;
+}
+
+void operator delete(void* p) noexcept {
+    if (p == nullptr) {
+        return;
+    }
+    void* block = (char*)p - headerSize;
+    const AllocationHeader& header = *(const AllocationHeader*)block;
+    if (header.stage != 0 && header.stage == currentStage) {
+        keptBytes -= header.size;
+    }
+    free(block);
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete[](void* p) noexcept { operator delete(p); }
+void operator delete(void* p, size_t) noexcept { operator delete(p); }
+void operator delete[](void* p, size_t) noexcept { operator delete(p); }
+
+namespace IMGTrace
+{
+
+// Friend of ImageTracer, calls its private stages
+struct StageAccess {
+    ImageTracer& tracer;
+
+    IndexedImage colorQuantization(const ImageData& img) { return tracer.colorQuantization(img); }
+    std::vector<NodeGrid> layering(const IndexedImage& ii) { return tracer.layering(ii); }
+    std::vector<SparseNodeGrid> tiledLayering(const IndexedImage& ii) { return tracer.tiledLayering(ii); }
+    template <class Layer>
+    threeDim<Internode> scanPaths(std::vector<Layer> layers) { return tracer.scanPaths(std::move(layers)); }
+    threeDim<Segment> batchTraceLayers(const threeDim<Internode>& binternodes) {
+        return tracer.batchTraceLayers(binternodes, tracer.options.ltres, tracer.options.qtres);
+    }
+};
+
+}
+
+using namespace IMGTrace;
+
+// Discards the output of an exporter
+class NullSink : public OutputSink {
+public:
+    bool write(const char*, size_t) override { return true; }
+};
+
+template <typename T>
+static long long vectorBytes(const std::vector<T>& v) {
+    return (long long)v.capacity() * sizeof(T);
+}
+
+template <typename T>
+static long long vectorBytes(const twoDim<T>& v) {
+    long long bytes = (long long)v.capacity() * sizeof(std::vector<T>);
+    for (const auto& inner : v) {
+        bytes += vectorBytes(inner);
+    }
+    return bytes;
+}
+
+template <typename T>
+static long long vectorBytes(const threeDim<T>& v) {
+    long long bytes = (long long)v.capacity() * sizeof(twoDim<T>);
+    for (const auto& inner : v) {
+        bytes += vectorBytes(inner);
+    }
+    return bytes;
+}
+
+static long long gridBytes(const Grid<uint8_t>& grid) {
+    return (long long)grid.stride() * grid.height();
+}
+
+static long long layerBytes(const std::vector<NodeGrid>& layers) {
+    long long bytes = vectorBytes(layers);
+    for (const auto& layer : layers) {
+        bytes += (long long)((layer.rowBytes() + 15) & ~15) * layer.height();
+    }
+    return bytes;
+}
+
+// Sparse layers hide their vectors, every stored node takes at most twice its 5 bytes
+static long long layerBytes(const std::vector<SparseNodeGrid>& layers) {
+    long long bytes = vectorBytes(layers);
+    for (const auto& layer : layers) {
+        bytes += 2 * (5LL * layer.size() + 4LL * (layer.height() + 1));
+    }
+    return bytes;
+}
+
+static int failures = 0;
+static int stageCount = 0;
+
+// Runs one stage and checks what it allocated against the size of its input and output
+template <class Run, class OutputBytes>
+static void measure(const std::string& name, long long inputBytes, bool checkScratch, Run run, OutputBytes outputBytes) {
+    allocatedBytes = 0;
+    keptBytes = 0;
+    currentStage = ++stageCount;
+    run();
+    currentStage = 0;
+    long long kept = keptBytes, scratch = allocatedBytes - keptBytes, output = outputBytes();
+    printf("allocation_test - %-40s input %9lld  output %9lld  kept %9lld  scratch %9lld\n",
+           name.c_str(), inputBytes, output, kept, scratch);
+    if (kept > output) {
+        fprintf(stderr, "allocation_test Error: %s keeps %lld bytes, its output has %lld\n", name.c_str(), kept, output);
+        failures++;
+    }
+    if (checkScratch && scratch >= inputBytes) {
+        fprintf(stderr, "allocation_test Error: %s allocates %lld scratch bytes for %lld input bytes\n",
+                name.c_str(), scratch, inputBytes);
+        failures++;
+    }
+}
+
+template <class Layer, class Layering>
+static void tracePipeline(ImageTracer& tracer, const ImageData& img, const std::string& name, bool checkScratch,
+                          Layering layering) {
+    StageAccess stages = { tracer };
+    long long imageBytes = (long long)img.width * img.height * 3;
+
+    IndexedImage ii;
+    measure(name + " colorQuantization", imageBytes, checkScratch,
+            [&]() { ii = stages.colorQuantization(img); },
+            [&]() { return vectorBytes(ii.palette) + gridBytes(ii.array); });
+
+    std::vector<Layer> layers;
+    measure(name + " layering", gridBytes(ii.array), checkScratch,
+            [&]() { layers = layering(stages, ii); },
+            [&]() { return layerBytes(layers); });
+
+    // The layers are moved in and consumed, the input is what the caller gave up
+    threeDim<Internode> binternodes;
+    long long scannedBytes = layerBytes(layers);
+    measure(name + " scanPaths", scannedBytes, checkScratch,
+            [&]() { binternodes = stages.scanPaths(std::move(layers)); },
+            [&]() { return vectorBytes(binternodes); });
+
+    measure(name + " batchTraceLayers", vectorBytes(binternodes), checkScratch,
+            [&]() { ii.layers = stages.batchTraceLayers(binternodes); },
+            [&]() { return vectorBytes(ii.layers); });
+    binternodes.clear();
+
+    measure(name + " createZOrder", vectorBytes(ii.layers), checkScratch,
+            [&]() { createZOrder(ii); },
+            [&]() { return vectorBytes(ii.zorder); });
+
+    NullSink sink;
+    SvgExporter svg(sink);
+    TraceExporter trace(sink);
+    for (Exporter* exporter : std::vector<Exporter*>{ &svg, &trace }) {
+        // Exporters buffer their output in a fixed block, only what they keep is checked
+        measure(name + (exporter == &svg ? " SvgExporter" : " TraceExporter"), vectorBytes(ii.layers), false,
+                [&]() { exporter->exportImage(ii, tracer.getOptions()); },
+                [&]() { return 0LL; });
+    }
+}
+
+// Threshold, k-means with the fused scan and k-means with sparse layers on 4 threads.
+static void traceImage(const ImageData& img, const std::string& name, bool checkScratch) {
+    auto dense = [](StageAccess& stages, const IndexedImage& ii) { return stages.layering(ii); };
+    auto sparse = [](StageAccess& stages, const IndexedImage& ii) { return stages.tiledLayering(ii); };
+
+    TracerOptions options;
+    ImageTracer tracer(options);
+    tracePipeline<NodeGrid>(tracer, img, name, checkScratch, dense);
+
+    options.quantization = QuantizationMethod::KMeans;
+    options.fusedScan = true;
+    tracer.setOptions(options);
+    tracePipeline<NodeGrid>(tracer, img, name + " kmeans fused", checkScratch, dense);
+
+    // Sparse layers can be smaller than the working memory of the path scan, only what the
+    // stages keep is checked
+    options.tileSize = 64;
+    options.threadCount = 4;
+    tracer.setOptions(options);
+    tracePipeline<SparseNodeGrid>(tracer, img, name + " kmeans tiled", false, sparse);
+}
+
+// Large white image with a few shapes, the layers and the index grid outweigh the paths
+static std::vector<uint8_t> flatImage(int size) {
+    std::vector<uint8_t> rgb((size_t)size * size * 3, 255);
+    auto fill = [&](int x0, int y0, int x1, int y1, uint8_t r, uint8_t g, uint8_t b) {
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                uint8_t* p = &rgb[((size_t)y * size + x) * 3];
+                p[0] = r; p[1] = g; p[2] = b;
+            }
+        }
+    };
+    fill(size / 8, size / 8, size / 4, size / 2, 0, 0, 0);
+    fill(size / 2, size / 4, size * 3 / 4, size * 3 / 8, 200, 30, 30);
+    fill(size / 3, size * 2 / 3, size * 7 / 8, size * 7 / 8, 30, 30, 200);
+    return rgb;
+}
+
+int main(int argc, const char * argv[]) {
+    std::string directory = argc > 1 ? argv[1] : "./testimages";
+    printf("allocation_test - stages of the test images\n"); // stdout buffer is allocated here
+
+    for (int i = 1; i <= 16; i++) {
+        std::string path = directory + "/" + std::to_string(i) + ".png";
+        int width, height, bpp;
+        unsigned char* rgb = stbi_load(path.c_str(), &width, &height, &bpp, 3);
+        if (rgb == NULL) {
+            fprintf(stderr, "allocation_test Error: could not load %s\n", path.c_str());
+            return 1;
+        }
+        ImageData img = { width, height, rgb };
+        traceImage(img, std::to_string(i) + ".png", false);
+        stbi_image_free(rgb);
+    }
+
+    const int flatSize = 1024;
+    std::vector<uint8_t> flat = flatImage(flatSize);
+    ImageData img = { flatSize, flatSize, flat.data() };
+    traceImage(img, "flat", true);
+
+    if (failures > 0) {
+        fprintf(stderr, "allocation_test Error: %d stages allocate more than their output\n", failures);
+        return 1;
+    }
+    printf("allocation_test - every stage allocates only its own output\n");
+    return 0;
+}
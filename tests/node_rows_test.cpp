@@ -0,0 +1,128 @@
+//
+//  node_rows_test.cpp
+//  ImageTracer
+//
+//  Compares the node row kernels the CPU supports with the scalar one, on random rows of every
+//  width up to 200 and on the quantized test images, with odd widths and row tails.
+//  node_rows_test [testimages directory]
+//
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include "color_quantizer.hpp"
+#include "node_rows.hpp"
+#include <stdio.h>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace IMGTrace;
+
+static const int guardSize = 64; // bytes after the output that no kernel may write
+static const uint8_t guardValue = 0xA5;
+
+static int failures = 0;
+
+// Runs every kernel on count nodes and compares the packed nodes and the guard bytes with the scalar kernel
+static void compareKernels(const std::vector<NamedNodeRowKernel>& kernels, const uint8_t* up, const uint8_t* down,
+                           int count, uint8_t color, const std::string& where) {
+    size_t size = (count + 1) / 2;
+    std::vector<uint8_t> expected(size + guardSize, guardValue);
+    kernels[0].kernel(up, down, expected.data(), count, color);
+    for (size_t k = size; k < expected.size(); k++) {
+        if (expected[k] != guardValue) {
+            fprintf(stderr, "node_rows_test Error: scalar wrote past %zu bytes, %s\n", size, where.c_str());
+            failures++;
+            return;
+        }
+    }
+    for (size_t n = 1; n < kernels.size(); n++) {
+        std::vector<uint8_t> out(size + guardSize, guardValue);
+        kernels[n].kernel(up, down, out.data(), count, color);
+        if (out != expected) {
+            size_t k = 0;
+            while (out[k] == expected[k]) {
+                k++;
+            }
+            fprintf(stderr, "node_rows_test Error: %s differs from scalar at byte %zu of %zu, count %d color %d, %s\n",
+                    kernels[n].name, k, size, count, color, where.c_str());
+            failures++;
+        }
+    }
+}
+
+// Rows of few colors so every node type occurs, starting at every alignment
+static void testRandomRows(const std::vector<NamedNodeRowKernel>& kernels) {
+    std::mt19937 random(1);
+    std::uniform_int_distribution<int> colors(0, 3);
+    const int maxCount = 200, maxOffset = 32;
+    std::vector<uint8_t> up(maxOffset + maxCount + 1), down(up.size());
+    for (int count = 1; count <= maxCount; count++) {
+        for (int offset = 0; offset < maxOffset; offset += 3) {
+            for (size_t k = 0; k < up.size(); k++) {
+                up[k] = (uint8_t)colors(random);
+                down[k] = (uint8_t)colors(random);
+            }
+            for (int color = 0; color < 4; color++) {
+                compareKernels(kernels, up.data() + offset, down.data() + offset, count, (uint8_t)color,
+                               "random row offset " + std::to_string(offset));
+            }
+        }
+    }
+}
+
+// Every node row of the quantized image for each palette color and the boundary, as whole rows
+// starting at the first columns and as short rows of every length
+static void testImage(const std::vector<NamedNodeRowKernel>& kernels, ColorQuantizer& quantizer,
+                      const ImageData& img, const std::string& name) {
+    std::vector<Color> palette;
+    Grid<uint8_t> array(img.width + 2, img.height + 2, boundaryIndex);
+    quantizer.quantize(img, palette, array);
+    int nodes = array.width() - 1;
+    for (int j = 1; j < array.height(); j++) {
+        std::string where = name + " row " + std::to_string(j);
+        for (int c = 0; c <= (int)palette.size(); c++) {
+            uint8_t color = c < (int)palette.size() ? (uint8_t)c : boundaryIndex;
+            for (int x0 = 0; x0 < 33 && x0 < nodes; x0++) {
+                compareKernels(kernels, array[j-1] + x0, array[j] + x0, nodes - x0, color, where);
+            }
+            for (int count = 1; count < 96 && count < nodes; count++) {
+                compareKernels(kernels, array[j-1], array[j], count, color, where);
+            }
+        }
+    }
+}
+
+int main(int argc, const char * argv[]) {
+    std::string directory = argc > 1 ? argv[1] : "./testimages";
+    std::vector<NamedNodeRowKernel> kernels = nodeRowKernels();
+    for (const auto& kernel : kernels) {
+        printf("node_rows_test - kernel %s\n", kernel.name);
+    }
+
+    testRandomRows(kernels);
+
+    for (int i = 1; i <= 16; i++) {
+        std::string path = directory + "/" + std::to_string(i) + ".png";
+        int width, height, bpp;
+        unsigned char* rgb = stbi_load(path.c_str(), &width, &height, &bpp, 3);
+        if (rgb == NULL) {
+            fprintf(stderr, "node_rows_test Error: could not load %s\n", path.c_str());
+            return 1;
+        }
+        ImageData img = { width, height, rgb };
+        ThresholdQuantizer threshold;
+        KMeansQuantizer kmeans(16);
+        testImage(kernels, threshold, img, path + " threshold");
+        testImage(kernels, kmeans, img, path + " kmeans");
+        stbi_image_free(rgb);
+    }
+
+    if (failures > 0) {
+        fprintf(stderr, "node_rows_test Error: %d mismatches\n", failures);
+        return 1;
+    }
+    printf("node_rows_test - %zu kernels agree\n", kernels.size());
+    return 0;
+}